@@ -0,0 +1,272 @@
+#!/usr/bin/env python
+
+# Tool for choosing KCSAN watchpoint parameters. Replays recorded per-CPU
+# memory access traces through a model of KCSAN's sampled watchpoints and
+# reports races found and added latency for a grid of configurations.
+#
+# A trace has one access per line, sorted by time:
+#   <time ns> <cpu> read|write <addr hex> <size> [atomic]
+
+from __future__ import print_function
+import getopt
+import heapq
+import json
+import multiprocessing
+import random
+import sys
+
+# Skip intervals, including the CONFIG_KCSAN_SKIP_WATCH default.
+DEFAULT_SKIP_INTERVALS = [400, 4000, 40000]
+
+# Watchpoint delays in us, including the CONFIG_KCSAN_UDELAY_TASK default.
+DEFAULT_DELAYS = [10, 80, 200]
+
+# Numbers of watchpoint slots, including the CONFIG_KCSAN_NUM_WATCHPOINTS
+# default.
+DEFAULT_SLOTS = [16, 64, 256]
+
+# Cost in ns of checking for watchpoints on an access that isn't watched.
+FAST_PATH_COST = 5
+
+# Watchpoint slots are chosen by address in granules of this size.
+WATCH_GRANULE = 8
+
+NS_PER_HOUR = 3600 * 1000000000
+
+
+def read_events(path):
+    with open(path) as f:
+        for line in f:
+            if line.startswith('#'):
+                continue
+            parts = line.split()
+            if len(parts) < 5:
+                continue
+            yield (int(parts[0]), int(parts[1]), parts[2] == 'write',
+                   int(parts[3], 16), int(parts[4]),
+                   len(parts) > 5 and parts[5] == 'atomic')
+
+
+class WatchpointModel(object):
+    """A model of KCSAN for a single configuration.
+
+    Every CPU counts down a randomized number of accesses before it watches
+    the next plain access. Watching takes a slot chosen by the address; if
+    that slot is busy the access is not watched. The watching CPU then
+    stalls for |delay|, and the first conflicting access from another CPU
+    to the watched memory during that time, marked or not, is reported as a
+    race and consumes the watchpoint.
+
+    The trace comes from a run without KCSAN, so watch windows are placed on
+    its timeline as is, and the time CPUs spend stalled is only accounted as
+    added latency.
+    """
+    def __init__(self, skip, delay, slots, seed):
+        self.skip = skip
+        self.delay = delay
+        self.slots = slots
+        self.random = random.Random(seed)
+        self.cpus = set()
+        self.countdown = {}
+        self.stalled = {}
+        self.watchpoints = {}
+        self.expiry = []
+        self.accesses = 0
+        self.watched = 0
+        self.busy = 0
+        self.reports = 0
+        self.races = set()
+        self.start = None
+        self.end = 0
+
+    def access(self, time, cpu, write, addr, size, atomic):
+        self.accesses += 1
+        self.cpus.add(cpu)
+        if self.start == None:
+            self.start = time
+        self.end = time
+
+        expiry = self.expiry
+        while expiry and expiry[0][0] <= time:
+            end, slot = heapq.heappop(expiry)
+            # The slot may have been freed by a report and taken again.
+            if self.watchpoints.get(slot, (None,))[-1] == end:
+                del self.watchpoints[slot]
+
+        # Check the slots the access may be watched in. As in
+        # check_access(), marked accesses are checked too.
+        first = addr // WATCH_GRANULE
+        last = (addr + size - 1) // WATCH_GRANULE
+        for granule in range(first, last + 1):
+            slot = granule % self.slots
+            watch = self.watchpoints.get(slot)
+            if watch == None:
+                continue
+            w_cpu, w_addr, w_size, w_write, _ = watch
+            if w_cpu == cpu or not (write or w_write):
+                continue
+            if w_addr + w_size <= addr or addr + size <= w_addr:
+                continue
+            del self.watchpoints[slot]
+            self.reports += 1
+            self.races.add((min(w_addr, addr), max(w_addr, addr)))
+
+        # As in should_watch(), atomic accesses are never watched and don't
+        # count towards the skip interval.
+        if atomic:
+            return
+        countdown = self.countdown.get(cpu)
+        if countdown == None:
+            countdown = self.random.randint(1, self.skip)
+        countdown -= 1
+        if countdown > 0:
+            self.countdown[cpu] = countdown
+            return
+        self.countdown[cpu] = self.random.randint(1, self.skip)
+
+        slot = first % self.slots
+        if slot in self.watchpoints:
+            self.busy += 1
+            return
+        self.watched += 1
+        self.watchpoints[slot] = (cpu, addr, size, write, time + self.delay)
+        heapq.heappush(expiry, (time + self.delay, slot))
+        self.stalled[cpu] = self.stalled.get(cpu, 0) + self.delay
+
+    def result(self):
+        duration = max(1, self.end - (self.start or 0))
+        cpus = max(1, len(self.cpus))
+        added = sum(self.stalled.values()) + self.accesses * FAST_PATH_COST
+        return {
+            'skip': self.skip,
+            'delay_us': self.delay / 1000.0,
+            'slots': self.slots,
+            'accesses': self.accesses,
+            'watchpoints': self.watched,
+            'busy_slots': self.busy,
+            'reports': self.reports,
+            'races': len(self.races),
+            'races_per_hour': len(self.races) * float(NS_PER_HOUR) / duration,
+            'added_latency': float(added) / (duration * cpus),
+        }
+
+
+def replay(args):
+    """Feeds every access of the trace to one WatchpointModel per
+    (skip, delay, slots) configuration, and returns their results.
+
+    All models are fed from a single pass over the trace, so that its
+    accesses are only parsed once however many configurations there are.
+    """
+    trace_path, configs, seed = args
+    models = [WatchpointModel(skip, delay, slots, seed)
+              for (skip, delay, slots) in configs]
+    for (time, cpu, write, addr, size, atomic) in read_events(trace_path):
+        for model in models:
+            model.access(time, cpu, write, addr, size, atomic)
+    return [model.result() for model in models]
+
+
+def evaluate(trace_path, configs, seed, jobs):
+    """Returns the results for |configs| in order, splitting the grid into
+    up to |jobs| contiguous parts that are replayed in parallel.
+
+    Every model draws its skip countdowns from its own generator seeded with
+    |seed|, so results don't depend on how the grid is split.
+    """
+    jobs = max(1, min(jobs, len(configs)))
+    part_size = max(1, (len(configs) + jobs - 1) // jobs)
+    parts = [(trace_path, configs[i:i + part_size], seed)
+             for i in range(0, len(configs), part_size)]
+    if len(parts) > 1:
+        pool = multiprocessing.Pool(len(parts))
+        part_results = pool.map(replay, parts)
+        pool.close()
+        pool.join()
+    else:
+        part_results = [replay(part) for part in parts]
+    return [result for results in part_results for result in results]
+
+
+def print_results(results):
+    print('%8s %9s %6s %12s %10s %8s %8s %12s %14s' % ('skip', 'delay',
+          'slots', 'watchpoints', 'busy', 'reports', 'races',
+          'races/hour', 'added latency'))
+    for result in results:
+        print('%8d %7gus %6d %12d %9.2f%% %8d %8d %12.1f %13.2f%%' % (
+              result['skip'], result['delay_us'], result['slots'],
+              result['watchpoints'],
+              100.0 * result['busy_slots'] /
+                  max(1, result['watchpoints'] + result['busy_slots']),
+              result['reports'], result['races'], result['races_per_hour'],
+              100.0 * result['added_latency']))
+
+
+def print_usage():
+    print('Usage: {0} --trace=<trace path>'.format(sys.argv[0]), end=' ')
+    print('[--skip=<accesses>,...]', end=' ')
+    print('[--delay=<us>,...]', end=' ')
+    print('[--slots=<number>,...]', end=' ')
+    print('[--jobs=<number>]', end=' ')
+    print('[--seed=<number>]', end=' ')
+    print('[--json]', end=' ')
+    print()
+
+
+def main():
+    try:
+        opts, args = getopt.getopt(sys.argv[1:], 't:j:',
+                ['trace=', 'skip=', 'delay=', 'slots=', 'jobs=', 'seed=',
+                 'json'])
+    except:
+        print_usage()
+        sys.exit(1)
+
+    trace_path = None
+    skips = DEFAULT_SKIP_INTERVALS
+    delays = DEFAULT_DELAYS
+    slots = DEFAULT_SLOTS
+    jobs = multiprocessing.cpu_count()
+    seed = 0
+    as_json = False
+
+    try:
+        for opt, arg in opts:
+            if opt in ('-t', '--trace'):
+                trace_path = arg
+            elif opt == '--skip':
+                skips = [int(x) for x in arg.split(',')]
+            elif opt == '--delay':
+                delays = [float(x) for x in arg.split(',')]
+            elif opt == '--slots':
+                slots = [int(x) for x in arg.split(',')]
+            elif opt in ('-j', '--jobs'):
+                jobs = int(arg)
+            elif opt == '--seed':
+                seed = int(arg)
+            elif opt == '--json':
+                as_json = True
+    except ValueError:
+        print_usage()
+        sys.exit(1)
+
+    if trace_path == None:
+        print_usage()
+        sys.exit(1)
+
+    # Times in the trace are in ns.
+    configs = [(skip, int(delay * 1000), slot_count)
+               for skip in skips for delay in delays for slot_count in slots]
+
+    results = evaluate(trace_path, configs, seed, jobs)
+    if as_json:
+        for result in results:
+            print(json.dumps(result, sort_keys=True))
+    else:
+        print_results(results)
+
+    sys.exit(0)
+
+
+if __name__ == '__main__':
+    main()
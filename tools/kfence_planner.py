@@ -0,0 +1,323 @@
+#!/usr/bin/env python
+
+# Tool for choosing KFENCE sample interval and pool size. Replays recorded
+# allocation traces through a model of the KFENCE pool and reports expected
+# detection probabilities, pool exhaustion rate and memory cost for a grid
+# of configurations.
+
+from __future__ import print_function
+from collections import defaultdict, deque
+import getopt
+import heapq
+import json
+import multiprocessing
+import struct
+import sys
+
+PAGE_SIZE = 4096
+
+# Sample intervals in ms, including the CONFIG_KFENCE_SAMPLE_INTERVAL default.
+DEFAULT_SAMPLE_INTERVALS = [10, 50, 100, 500]
+
+# Pool sizes, including the CONFIG_KFENCE_NUM_OBJECTS default.
+DEFAULT_NUM_OBJECTS = [63, 255, 1023]
+
+# Delays in ms between a free and a use-after-free access.
+DEFAULT_UAF_DELAYS = [1, 100, 10000]
+
+# Binary traces start with this magic, followed by the offset of the cache
+# name table. Each record is (time in ns, lifetime in ns, size, cache id).
+TRACE_MAGIC = b'KFTRACE1'
+TRACE_HEADER = struct.Struct('<8sQ')
+TRACE_RECORD = struct.Struct('<QQIH')
+
+# Number of records read from a binary trace at once.
+READ_RECORDS = 1 << 16
+
+
+class TextTrace(object):
+    """An allocation trace with one '<time ns> <size> <cache> <lifetime ns>'
+    line per allocation, sorted by time. Lines starting with '#' are ignored.
+    """
+    def __init__(self, path):
+        self.path = path
+
+    def events(self):
+        with open(self.path) as f:
+            for line in f:
+                if line.startswith('#'):
+                    continue
+                parts = line.split()
+                if len(parts) != 4:
+                    continue
+                yield (int(parts[0]), int(parts[1]), parts[2], int(parts[3]))
+
+
+class BinaryTrace(object):
+    """An allocation trace converted by --compile, which is several times
+    faster to replay than a text trace.
+    """
+    def __init__(self, path):
+        self.path = path
+
+    def events(self):
+        with open(self.path, 'rb') as f:
+            magic, names_offset = TRACE_HEADER.unpack(
+                    f.read(TRACE_HEADER.size))
+            if magic != TRACE_MAGIC:
+                raise ValueError('bad trace file: %s' % self.path)
+            f.seek(names_offset)
+            caches = json.loads(f.read().decode('utf-8'))
+
+            f.seek(TRACE_HEADER.size)
+            remaining = names_offset - TRACE_HEADER.size
+            while remaining > 0:
+                chunk = f.read(min(remaining,
+                                   READ_RECORDS * TRACE_RECORD.size))
+                remaining -= len(chunk)
+                for (time, lifetime, size, cache) in \
+                        TRACE_RECORD.iter_unpack(chunk):
+                    yield (time, size, caches[cache], lifetime)
+
+
+def open_trace(path):
+    with open(path, 'rb') as f:
+        if f.read(len(TRACE_MAGIC)) == TRACE_MAGIC:
+            return BinaryTrace(path)
+    return TextTrace(path)
+
+
+def compile_trace(text_path, binary_path):
+    caches = {}
+    with open(binary_path, 'wb') as out:
+        out.write(TRACE_HEADER.pack(TRACE_MAGIC, 0))
+        for (time, size, cache, lifetime) in TextTrace(text_path).events():
+            if cache not in caches:
+                caches[cache] = len(caches)
+            out.write(TRACE_RECORD.pack(time, lifetime, size, caches[cache]))
+        names_offset = out.tell()
+        names = sorted(caches, key=caches.get)
+        out.write(json.dumps(names).encode('utf-8'))
+        out.seek(0)
+        out.write(TRACE_HEADER.pack(TRACE_MAGIC, names_offset))
+
+
+class PoolModel(object):
+    """A model of the KFENCE pool for a single configuration.
+
+    After every sample interval, the next allocation that fits in a page is
+    redirected to the pool if it has a free object, and the interval starts
+    again. Freed objects go to the tail of the freelist and allocations take
+    from its head, so a freed object stays protected for as long as possible.
+
+    Detection probabilities are per allocation in the trace:
+    - out-of-bounds writes are caught by either a guard page or the canary
+      bytes checked on free, so any sampled allocation catches them;
+    - out-of-bounds reads are only caught by the guard page on the side the
+      object is aligned to, which is chosen at random;
+    - use-after-free accesses |delay| after the free are caught if the object
+      hasn't been reused by then.
+    """
+    def __init__(self, sample_interval, num_objects, uaf_delays):
+        self.sample_interval = sample_interval
+        self.num_objects = num_objects
+        self.uaf_delays = uaf_delays
+        self.next_sample = 0
+        self.freelist = deque(range(num_objects))
+        self.live = []
+        self.freed_at = [None] * num_objects
+        self.allocations = 0
+        self.attempts = 0
+        self.exhausted = 0
+        self.sampled = 0
+        self.uaf_detected = [0] * len(uaf_delays)
+        self.cache_allocations = defaultdict(int)
+        self.cache_sampled = defaultdict(int)
+
+    def alloc(self, time, size, cache, lifetime):
+        self.allocations += 1
+        self.cache_allocations[cache] += 1
+        live = self.live
+        while live and live[0][0] <= time:
+            self.freelist.append(heapq.heappop(live)[1])
+
+        if time < self.next_sample or size > PAGE_SIZE:
+            return
+        self.attempts += 1
+        self.next_sample = time + self.sample_interval
+        if not self.freelist:
+            self.exhausted += 1
+            return
+
+        slot = self.freelist.popleft()
+        if self.freed_at[slot] != None:
+            self.close_window(time - self.freed_at[slot])
+        self.sampled += 1
+        self.cache_sampled[cache] += 1
+        self.freed_at[slot] = time + lifetime
+        heapq.heappush(live, (time + lifetime, slot))
+
+    def close_window(self, window):
+        for i, delay in enumerate(self.uaf_delays):
+            if window > delay:
+                self.uaf_detected[i] += 1
+
+    def finish(self):
+        # Objects that were never reused stay protected forever.
+        for freed_at in self.freed_at:
+            if freed_at != None:
+                self.close_window(float('inf'))
+
+    def result(self):
+        allocations = max(1, self.allocations)
+        result = {
+            'sample_interval_ms': self.sample_interval / 1000000.0,
+            'num_objects': self.num_objects,
+            'memory_bytes': (self.num_objects + 1) * 2 * PAGE_SIZE,
+            'allocations': self.allocations,
+            'sampled': self.sampled,
+            'exhaustion_rate': float(self.exhausted) / max(1, self.attempts),
+            'detection': {
+                'out-of-bounds-write': float(self.sampled) / allocations,
+                'out-of-bounds-read': 0.5 * self.sampled / allocations,
+            },
+            'cache_sampled_fraction': dict(
+                (cache, float(self.cache_sampled[cache]) / count)
+                for (cache, count) in self.cache_allocations.items()),
+        }
+        for delay, detected in zip(self.uaf_delays, self.uaf_detected):
+            key = 'use-after-free-%gms' % (delay / 1000000.0)
+            result['detection'][key] = float(detected) / allocations
+        return result
+
+
+def simulate(args):
+    """Replays the trace once through the models of several configurations.
+    """
+    trace_path, configs, uaf_delays = args
+    models = [PoolModel(interval, objects, uaf_delays)
+              for (interval, objects) in configs]
+    for (time, size, cache, lifetime) in open_trace(trace_path).events():
+        for model in models:
+            model.alloc(time, size, cache, lifetime)
+    results = []
+    for model in models:
+        model.finish()
+        results.append(model.result())
+    return results
+
+
+def plan(trace_path, configs, uaf_delays, jobs):
+    """Returns the results for |configs| in order.
+
+    The grid is cut into up to |jobs| contiguous parts, and each part is
+    simulated in its own process with a single pass over the trace. The pool
+    models are deterministic, so results don't depend on the cut.
+    """
+    jobs = max(1, min(jobs, len(configs)))
+    part_size = max(1, (len(configs) + jobs - 1) // jobs)
+    parts = [(trace_path, configs[i:i + part_size], uaf_delays)
+             for i in range(0, len(configs), part_size)]
+    if len(parts) > 1:
+        pool = multiprocessing.Pool(len(parts))
+        part_results = pool.map(simulate, parts)
+        pool.close()
+        pool.join()
+    else:
+        part_results = [simulate(part) for part in parts]
+    return [result for results in part_results for result in results]
+
+
+def print_results(results):
+    keys = list(results[0]['detection'].keys())
+    print('%10s %8s %10s %10s' % ('interval', 'objects', 'memory',
+                                   'exhausted'), end='')
+    for key in keys:
+        print(' %22s' % key, end='')
+    print()
+    for result in results:
+        print('%8gms %8d %9dK %9.2f%%' % (result['sample_interval_ms'],
+              result['num_objects'], result['memory_bytes'] // 1024,
+              result['exhaustion_rate'] * 100), end='')
+        for key in keys:
+            print(' %21.4f%%' % (result['detection'][key] * 100), end='')
+        print()
+
+
+def parse_list(arg):
+    return [float(x) for x in arg.split(',')]
+
+
+def print_usage():
+    print('Usage: {0} --trace=<trace path>'.format(sys.argv[0]), end=' ')
+    print('[--sample-interval=<ms>,...]', end=' ')
+    print('[--num-objects=<number>,...]', end=' ')
+    print('[--uaf-delay=<ms>,...]', end=' ')
+    print('[--jobs=<number>]', end=' ')
+    print('[--json]', end=' ')
+    print('[--compile=<binary trace path>]', end=' ')
+    print()
+
+
+def main():
+    try:
+        opts, args = getopt.getopt(sys.argv[1:], 't:j:',
+                ['trace=', 'sample-interval=', 'num-objects=', 'uaf-delay=',
+                 'jobs=', 'json', 'compile='])
+    except:
+        print_usage()
+        sys.exit(1)
+
+    trace_path = None
+    sample_intervals = DEFAULT_SAMPLE_INTERVALS
+    num_objects = DEFAULT_NUM_OBJECTS
+    uaf_delays = DEFAULT_UAF_DELAYS
+    jobs = multiprocessing.cpu_count()
+    as_json = False
+    compile_path = None
+
+    try:
+        for opt, arg in opts:
+            if opt in ('-t', '--trace'):
+                trace_path = arg
+            elif opt == '--sample-interval':
+                sample_intervals = parse_list(arg)
+            elif opt == '--num-objects':
+                num_objects = [int(x) for x in parse_list(arg)]
+            elif opt == '--uaf-delay':
+                uaf_delays = parse_list(arg)
+            elif opt in ('-j', '--jobs'):
+                jobs = int(arg)
+            elif opt == '--json':
+                as_json = True
+            elif opt == '--compile':
+                compile_path = arg
+    except ValueError:
+        print_usage()
+        sys.exit(1)
+
+    if trace_path == None:
+        print_usage()
+        sys.exit(1)
+
+    if compile_path != None:
+        compile_trace(trace_path, compile_path)
+        sys.exit(0)
+
+    # Times in the trace are in ns.
+    configs = [(int(interval * 1000000), objects)
+               for interval in sample_intervals for objects in num_objects]
+    uaf_delays = [int(delay * 1000000) for delay in uaf_delays]
+
+    results = plan(trace_path, configs, uaf_delays, jobs)
+    if as_json:
+        for result in results:
+            print(json.dumps(result, sort_keys=True))
+    else:
+        print_results(results)
+
+    sys.exit(0)
+
+
+if __name__ == '__main__':
+    main()
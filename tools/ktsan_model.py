@@ -0,0 +1,706 @@
+#!/usr/bin/env python
+
+# Userspace model of the KTSAN happens-before race detection algorithm.
+# Replays recorded memory access and synchronization traces to compare
+# shadow slot encodings.
+#
+# A trace has one event per line:
+#   <tid> read|write <addr hex> <size>
+#   <tid> acquire|release <sync id>
+#   <tid> create|join <tid>
+#   <tid> on|off <cpu>
+
+from __future__ import print_function
+from collections import OrderedDict
+import getopt
+import random
+import sys
+import time
+
+# Shadow memory describes memory in granules of this many bytes.
+GRANULE_SIZE = 8
+
+# Number of bits used for the access offset, size and type in a slot.
+FLAGS_BITS = 8
+
+
+class Encoding(object):
+    """Layout of a single shadow slot.
+
+    A slot is packed into an integer as |tid|, |clock| and flags (3 bits of
+    offset in the granule, 2 bits of log2 of the access size, 1 bit for
+    writes), from the most to the least significant bits.
+    """
+    def __init__(self, name, slot_size, tid_bits, clock_bits):
+        assert tid_bits + clock_bits + FLAGS_BITS <= slot_size * 8
+        self.name = name
+        self.slot_size = slot_size
+        self.tid_bits = tid_bits
+        self.clock_bits = clock_bits
+        self.max_tids = 1 << tid_bits
+        self.clock_mask = (1 << clock_bits) - 1
+
+    def pack(self, tid, clock, offset, size_log, write):
+        return (((tid << self.clock_bits) | (clock & self.clock_mask))
+                << FLAGS_BITS) | (offset << 3) | (size_log << 1) | write
+
+    def unpack(self, slot):
+        flags = slot & ((1 << FLAGS_BITS) - 1)
+        slot >>= FLAGS_BITS
+        return (slot >> self.clock_bits, slot & self.clock_mask,
+                flags >> 3, (flags >> 1) & 3, flags & 1)
+
+
+ENCODINGS = {
+    # 8-byte slots as in the current prototype (and TSan v2).
+    'current': Encoding('current', 8, 13, 42),
+    # 4-byte slots: 1 byte for the thread id, 2 for the clock, 1 for flags.
+    'compact': Encoding('compact', 4, 8, 16),
+}
+
+# Size of a vector clock cache entry: a sync object id and a version.
+VC_CACHE_ENTRY_SIZE = 16
+
+# Cost model of a global flush, in nanoseconds: shadow is cleared at memset
+# speed (about 10GB/s), a sync object costs a cache miss to reset, and each
+# of its vector clock entries a store.
+FLUSH_NS_PER_SHADOW_BYTE = 0.1
+FLUSH_NS_PER_SYNC = 100
+FLUSH_NS_PER_VC_ENTRY = 1
+
+# Encoding used for the reference run. Thread ids and clocks never wrap and
+# granules keep a slot for every thread, so it finds every race the trace has.
+EXACT = Encoding('exact', 16, 32, 64)
+
+
+class FlushWork(object):
+    """Work done by a global flush while every thread is stopped.
+
+    |threads| is the number of live threads, each of which still has to reset
+    its own clock after the flush.
+    """
+    def __init__(self, shadow_bytes, syncs, vc_entries, cache_bytes, threads):
+        self.shadow_bytes = shadow_bytes
+        self.syncs = syncs
+        self.vc_entries = vc_entries
+        self.cache_bytes = cache_bytes
+        self.threads = threads
+
+    def pause_ns(self):
+        return ((self.shadow_bytes + self.cache_bytes) *
+                FLUSH_NS_PER_SHADOW_BYTE + self.syncs * FLUSH_NS_PER_SYNC +
+                self.vc_entries * FLUSH_NS_PER_VC_ENTRY)
+
+
+class Thread(object):
+    def __init__(self, tid, encoded_tid):
+        self.tid = tid
+        self.encoded_tid = encoded_tid
+        self.clock = 1
+        self.vc = {encoded_tid: 1}
+        # Changes whenever an entry of another thread in |vc| grows.
+        self.vc_version = 0
+        # Value of the global flush epoch when the thread last flushed.
+        self.epoch = 0
+
+
+class VcCache(object):
+    """An LRU cache of the sync object versions a thread has already
+    acquired or released.
+
+    Acquiring a version of a sync object that the thread already acquired is
+    a no-op. Releasing to a sync object when the thread didn't acquire
+    anything since its last release there only updates the thread's own
+    clock. Otherwise, the whole vector clock has to be joined.
+    """
+    def __init__(self, size):
+        self.size = size
+        self.entries = OrderedDict()
+
+    def lookup(self, key, version):
+        if self.entries.get(key) != version:
+            return False
+        self.entries.move_to_end(key)
+        return True
+
+    def peek(self, key):
+        return self.entries.get(key)
+
+    def drop(self, tid):
+        for key in [key for key in self.entries if key[0] == tid]:
+            del self.entries[key]
+
+    def store(self, key, version):
+        self.entries[key] = version
+        self.entries.move_to_end(key)
+        if len(self.entries) > self.size:
+            self.entries.popitem(last=False)
+
+
+class Detector(object):
+    """Happens-before race detector over a slot-based shadow memory.
+
+    Every event advances the clock of its thread. Each granule has at most
+    |slots| shadow slots; when all are taken by other threads, a random one
+    is evicted, which may hide a race.
+
+    If |vc_cache| is 'thread' or 'cpu', acquire and release operations go
+    through VcCaches kept per thread or per CPU. Since vector clocks stay per
+    thread, entries of a per-CPU cache are tagged with the thread id and
+    don't survive other threads running on that CPU for long.
+
+    If |flush| is set, clock overflows are handled by a global flush instead
+    of letting clocks wrap around. A flush clears the shadow memory and sync
+    objects and bumps the global epoch; every thread resets its own clock on
+    its next event, once it notices that its epoch lags behind. Thread ids
+    of exited threads are also reused, and a new owner of an id continues
+    the clock of the old one, so that the old thread happens-before the new.
+    In every mode, a joined thread is gone along with its cache entries.
+    """
+    def __init__(self, encoding, slots, seed=0, vc_cache=None,
+                 vc_cache_size=64, flush=False):
+        self.encoding = encoding
+        self.slots = slots
+        self.random = random.Random(seed)
+        self.shadow = {}
+        self.threads = {}
+        # Number of threads seen, including exited ones.
+        self.thread_count = 0
+        self.syncs = {}
+        self.sync_versions = {}
+        self.vc_cache = vc_cache
+        self.vc_cache_size = vc_cache_size
+        self.vc_caches = {}
+        self.cpus = {}
+        self.switches = 0
+        self.acquires = 0
+        self.releases = 0
+        # Vector clock entries touched by acquires and releases.
+        self.acquire_cost = 0
+        self.release_cost = 0
+        self.cache_lookups = 0
+        self.cache_hits = 0
+        self.flush = flush
+        self.global_epoch = 0
+        # Work done by each global flush, see global_flush().
+        self.flushes = []
+        # Threads that reset their clock after a flush, and the vector clock
+        # entries they dropped.
+        self.catch_ups = 0
+        self.catch_up_entries = 0
+        # Encoded thread ids of exited threads, with their last clock and
+        # vector clock.
+        self.free_tids = []
+        self.exited_tids = {}
+        self.next_tid = 0
+        self.accesses = 0
+        self.evictions = 0
+        # Indices of the accesses on which a race was reported.
+        self.races = set()
+
+    def thread(self, tid):
+        thread = self.threads.get(tid)
+        if thread == None:
+            thread = Thread(tid, self.encode_tid(tid))
+            thread.epoch = self.global_epoch
+            self.threads[tid] = thread
+            self.thread_count += 1
+            self.inherit_tid(thread)
+        if thread.epoch < self.global_epoch:
+            self.self_flush(thread)
+        return thread
+
+    def encode_tid(self, tid):
+        if self.flush:
+            if self.free_tids:
+                return self.free_tids.pop(0)
+            if self.next_tid < self.encoding.max_tids:
+                self.next_tid += 1
+                return self.next_tid - 1
+        # With few thread id bits, different threads share an id.
+        return tid % self.encoding.max_tids
+
+    def inherit_tid(self, thread):
+        state = self.exited_tids.pop(thread.encoded_tid, None)
+        if state == None:
+            return
+        thread.clock, vc = state
+        join_vc(thread.vc, vc)
+        self.tick(thread)
+
+    def exit_thread(self, thread):
+        del self.threads[thread.tid]
+        # A thread that reuses the id starts with empty caches.
+        if self.vc_cache == 'thread':
+            self.vc_caches.pop(thread.tid, None)
+        else:
+            for cache in self.vc_caches.values():
+                cache.drop(thread.tid)
+        if self.flush:
+            self.exited_tids[thread.encoded_tid] = (thread.clock, thread.vc)
+            self.free_tids.append(thread.encoded_tid)
+
+    def tick(self, thread):
+        if self.flush and thread.clock >= self.encoding.clock_mask:
+            self.global_flush()
+            self.self_flush(thread)
+        thread.clock += 1
+        thread.vc[thread.encoded_tid] = thread.clock
+
+    def global_flush(self):
+        # The pause is modeled from the work rather than timed, since clearing
+        # a dict costs nothing like clearing the shadow. The model only knows
+        # the granules touched since the last flush, so shadow clearing is a
+        # lower bound for a kernel that would clear all of it.
+        slots = self.slots or max([len(s) for s in self.shadow.values()] or [0])
+        shadow_bytes = len(self.shadow) * slots * self.encoding.slot_size
+        vc_entries = sum([len(vc) for vc in self.syncs.values()])
+        self.flushes.append(FlushWork(shadow_bytes, len(self.syncs),
+                                      vc_entries, self.vc_cache_bytes(),
+                                      len(self.threads)))
+        self.global_epoch += 1
+        self.shadow.clear()
+        self.syncs.clear()
+        self.sync_versions.clear()
+        self.vc_caches.clear()
+        # Clocks of exited threads are gone as well.
+        self.exited_tids.clear()
+
+    def self_flush(self, thread):
+        self.catch_ups += 1
+        self.catch_up_entries += len(thread.vc)
+        thread.clock = 1
+        thread.vc = {thread.encoded_tid: 1}
+        thread.vc_version += 1
+        thread.epoch = self.global_epoch
+
+    def access(self, tid, addr, size, write):
+        thread = self.thread(tid)
+        self.tick(thread)
+        self.accesses += 1
+        while size > 0:
+            granule = addr - addr % GRANULE_SIZE
+            offset = addr - granule
+            chunk = min(size, GRANULE_SIZE - offset)
+            self.access_granule(thread, granule, offset, chunk, write)
+            addr += chunk
+            size -= chunk
+
+    def access_granule(self, thread, granule, offset, size, write):
+        encoding = self.encoding
+        size_log = min(3, size.bit_length() - 1)
+        slots = self.shadow.setdefault(granule, [])
+        replace = None
+        for i, slot in enumerate(slots):
+            s_tid, s_clock, s_offset, s_size_log, s_write = \
+                encoding.unpack(slot)
+            if s_offset + (1 << s_size_log) <= offset or \
+                    offset + (1 << size_log) <= s_offset:
+                continue
+            if s_tid == thread.encoded_tid:
+                if write or not s_write:
+                    replace = i
+                continue
+            if not (write or s_write):
+                continue
+            known = thread.vc.get(s_tid, 0) & encoding.clock_mask
+            if s_clock > known:
+                self.races.add(self.accesses)
+
+        slot = encoding.pack(thread.encoded_tid, thread.clock, offset,
+                             size_log, int(write))
+        if replace != None:
+            slots[replace] = slot
+        elif self.slots == None or len(slots) < self.slots:
+            slots.append(slot)
+        else:
+            self.evictions += 1
+            slots[self.random.randrange(len(slots))] = slot
+
+    def acquire(self, tid, sync):
+        thread = self.thread(tid)
+        self.tick(thread)
+        self.acquires += 1
+        version = self.sync_versions.get(sync, 0)
+        if self.cache_lookup(thread, ('acquire', sync), version):
+            self.acquire_cost += 1
+            return
+        sync_vc = self.syncs.get(sync, {})
+        self.acquire_cost += len(sync_vc)
+        if join_vc(thread.vc, sync_vc):
+            thread.vc_version += 1
+        self.cache_store(thread, ('acquire', sync), version)
+
+    def release(self, tid, sync):
+        thread = self.thread(tid)
+        self.releases += 1
+        sync_vc = self.syncs.setdefault(sync, {})
+        version = self.sync_versions.get(sync, 0)
+        self.sync_versions[sync] = version + 1
+        if self.cache_lookup(thread, ('release', sync), thread.vc_version):
+            # Sync object clocks only grow, so only the own clock is stale.
+            self.release_cost += 1
+            join_vc(sync_vc, {thread.encoded_tid: thread.clock})
+        else:
+            self.release_cost += len(thread.vc)
+            join_vc(sync_vc, thread.vc)
+            self.cache_store(thread, ('release', sync), thread.vc_version)
+        # The new version only adds what the thread released, so if the
+        # thread has acquired the previous one, it has the new one as well.
+        self.cache_refresh(thread, ('acquire', sync), version, version + 1)
+        self.tick(thread)
+
+    def create(self, tid, child_tid):
+        thread = self.thread(tid)
+        child = self.thread(child_tid)
+        join_vc(child.vc, thread.vc)
+        child.vc_version += 1
+        self.tick(thread)
+
+    def join(self, tid, child_tid):
+        thread = self.thread(tid)
+        self.tick(thread)
+        child = self.thread(child_tid)
+        if join_vc(thread.vc, child.vc):
+            thread.vc_version += 1
+        self.exit_thread(child)
+
+    def schedule(self, tid, cpu):
+        self.cpus[tid] = cpu
+        self.switches += 1
+
+    def deschedule(self, tid, cpu):
+        self.cpus.pop(tid, None)
+
+    def cache_for(self, thread):
+        if self.vc_cache == 'thread':
+            owner = thread.tid
+        elif self.vc_cache == 'cpu':
+            owner = self.cpus.get(thread.tid)
+        else:
+            return None
+        cache = self.vc_caches.get(owner)
+        if cache == None:
+            cache = VcCache(self.vc_cache_size)
+            self.vc_caches[owner] = cache
+        return cache
+
+    def cache_lookup(self, thread, key, version):
+        cache = self.cache_for(thread)
+        if cache == None:
+            return False
+        self.cache_lookups += 1
+        if cache.lookup((thread.tid,) + key, version):
+            self.cache_hits += 1
+            return True
+        return False
+
+    def cache_store(self, thread, key, version):
+        cache = self.cache_for(thread)
+        if cache != None:
+            cache.store((thread.tid,) + key, version)
+
+    def cache_refresh(self, thread, key, version, new_version):
+        cache = self.cache_for(thread)
+        if cache != None and cache.peek((thread.tid,) + key) == version:
+            cache.store((thread.tid,) + key, new_version)
+
+    def vc_cache_bytes(self):
+        return len(self.vc_caches) * self.vc_cache_size * VC_CACHE_ENTRY_SIZE
+
+
+def join_vc(dst, src):
+    """Joins |src| into |dst| and returns whether |dst| changed."""
+    changed = False
+    for tid, clock in src.items():
+        if dst.get(tid, 0) < clock:
+            dst[tid] = clock
+            changed = True
+    return changed
+
+
+def read_trace(path):
+    events = []
+    with open(path) as f:
+        for line in f:
+            parts = line.split()
+            if len(parts) < 3 or line.startswith('#'):
+                continue
+            tid, op = int(parts[0]), parts[1]
+            if op in ('read', 'write'):
+                events.append((tid, op, int(parts[2], 16), int(parts[3])))
+            else:
+                events.append((tid, op, int(parts[2]), None))
+    return events
+
+
+def replay(detector, events):
+    for (tid, op, arg, size) in events:
+        if op == 'read':
+            detector.access(tid, arg, size, False)
+        elif op == 'write':
+            detector.access(tid, arg, size, True)
+        elif op == 'acquire':
+            detector.acquire(tid, arg)
+        elif op == 'release':
+            detector.release(tid, arg)
+        elif op == 'create':
+            detector.create(tid, arg)
+        elif op == 'join':
+            detector.join(tid, arg)
+        elif op == 'on':
+            detector.schedule(tid, arg)
+        elif op == 'off':
+            detector.deschedule(tid, arg)
+
+
+def generate_trace(path, threads, events, locks, cpus, churn, seed):
+    """Writes a random trace of threads that mostly access memory under
+    locks and sometimes access shared memory without them. Threads run on
+    |cpus| CPUs for bursts of events and are then switched out. With
+    probability |churn|, a switched out thread exits and is replaced by a
+    new one.
+    """
+    rng = random.Random(seed)
+    protected = [[0x1000 + (lock * 64 + i) * GRANULE_SIZE for i in range(8)]
+                 for lock in range(locks)]
+    racy = [0x100000 + i * GRANULE_SIZE for i in range(64)]
+    held = {}
+    cpus = min(cpus, threads)
+    running = [None] * cpus
+    burst = [0] * cpus
+    alive = list(range(1, threads + 1))
+    next_tid = threads + 1
+    with open(path, 'w') as f:
+        for tid in alive:
+            f.write('0 create %d\n' % tid)
+        for i in range(events):
+            cpu = rng.randrange(cpus)
+            if burst[cpu] == 0:
+                old_tid = running[cpu]
+                running[cpu] = None
+                if old_tid != None:
+                    f.write('%d off %d\n' % (old_tid, cpu))
+                    if old_tid not in held and rng.random() < churn:
+                        f.write('0 join %d\n' % old_tid)
+                        f.write('0 create %d\n' % next_tid)
+                        alive[alive.index(old_tid)] = next_tid
+                        next_tid += 1
+                tid = rng.choice(alive)
+                while tid in running:
+                    tid = rng.choice(alive)
+                f.write('%d on %d\n' % (tid, cpu))
+                running[cpu] = tid
+                burst[cpu] = rng.randint(10, 100)
+            tid = running[cpu]
+            burst[cpu] -= 1
+            if tid in held:
+                lock = held[tid]
+                if rng.random() < 0.2:
+                    f.write('%d release %d\n' % (tid, lock))
+                    del held[tid]
+                    continue
+                addr = rng.choice(protected[lock])
+            elif rng.random() < 0.3:
+                lock = rng.randrange(locks)
+                if lock in held.values():
+                    continue
+                f.write('%d acquire %d\n' % (tid, lock))
+                held[tid] = lock
+                continue
+            elif rng.random() < 0.01:
+                addr = rng.choice(racy)
+            else:
+                # Thread-local memory.
+                addr = 0x10000000 + tid * 0x10000 + rng.randrange(512) * 8
+            op = 'write' if rng.random() < 0.3 else 'read'
+            size = rng.choice([1, 2, 4, 8])
+            addr += rng.randrange(GRANULE_SIZE // size) * size
+            f.write('%d %s %x %d\n' % (tid, op, addr, size))
+
+
+def benchmark(events, encodings, slots):
+    reference = Detector(EXACT, None)
+    replay(reference, events)
+
+    print('%10s %10s %16s %14s %8s %10s %16s %16s' % ('encoding',
+          'slot size', 'shadow per byte', 'accesses/sec', 'races',
+          'evictions', 'false negatives', 'false positives'))
+    for encoding in encodings:
+        detector = Detector(encoding, slots)
+        start = time.time()
+        replay(detector, events)
+        elapsed = max(time.time() - start, 1e-9)
+
+        missed = len(reference.races - detector.races)
+        spurious = len(detector.races - reference.races)
+        print('%10s %9dB %15.2fB %14d %8d %10d %15.2f%% %16d' % (
+              encoding.name, encoding.slot_size,
+              float(slots * encoding.slot_size) / GRANULE_SIZE,
+              detector.accesses / elapsed, len(detector.races),
+              detector.evictions,
+              100.0 * missed / max(1, len(reference.races)), spurious))
+    print('reference: %d races' % len(reference.races))
+
+
+def benchmark_vc_cache(events, variants, slots, vc_cache_size):
+    print('%8s %8s %12s %10s %14s %14s %14s' % ('vc cache', 'caches',
+          'memory', 'hit rate', 'acquire cost', 'release cost',
+          'sync ops/sec'))
+    for variant in variants:
+        detector = Detector(ENCODINGS['current'], slots,
+                            vc_cache=None if variant == 'none' else variant,
+                            vc_cache_size=vc_cache_size)
+        start = time.time()
+        replay(detector, events)
+        elapsed = max(time.time() - start, 1e-9)
+
+        syncs = detector.acquires + detector.releases
+        print('%8s %8d %11dK %9.2f%% %14.2f %14.2f %14d' % (variant,
+              len(detector.vc_caches), detector.vc_cache_bytes() // 1024,
+              100.0 * detector.cache_hits / max(1, detector.cache_lookups),
+              float(detector.acquire_cost) / max(1, detector.acquires),
+              float(detector.release_cost) / max(1, detector.releases),
+              syncs / elapsed))
+    print('%d threads, %d context switches' % (detector.thread_count,
+          detector.switches))
+
+
+def benchmark_flush(events, encoding, slots):
+    reference = Detector(EXACT, None)
+    replay(reference, events)
+
+    print('%8s %8s %14s %10s %10s %14s %14s %14s %16s %16s' % ('flush',
+          'flushes', 'shadow', 'syncs', 'catch-ups', 'total pause',
+          'max pause', 'accesses/sec', 'false negatives', 'false positives'))
+    for flush in [False, True]:
+        detector = Detector(encoding, slots, flush=flush)
+        start = time.time()
+        replay(detector, events)
+        elapsed = max(time.time() - start, 1e-9)
+
+        missed = len(reference.races - detector.races)
+        spurious = len(detector.races - reference.races)
+        flushes = detector.flushes
+        pauses = [work.pause_ns() / 1e6 for work in flushes]
+        print('%8s %8d %13dK %10d %10d %12.2fms %12.2fms %14d %15.2f%% %16d' % (
+              'yes' if flush else 'no', len(flushes),
+              sum([work.shadow_bytes for work in flushes]) // 1024,
+              sum([work.syncs for work in flushes]), detector.catch_ups,
+              sum(pauses), max(pauses or [0]), detector.accesses / elapsed,
+              100.0 * missed / max(1, len(reference.races)), spurious))
+    print('reference: %d races' % len(reference.races))
+
+
+def print_usage():
+    print('Usage: {0} --trace=<trace path>'.format(sys.argv[0]), end=' ')
+    print('[--encoding=<current|compact>,...]', end=' ')
+    print('[--slots=<slots per granule>]', end=' ')
+    print('[--vc-cache=<none|thread|cpu>,... [--vc-cache-size=<entries>]]',
+          end=' ')
+    print('[--flush [--clock-bits=<bits>]]', end=' ')
+    print('[--generate [--threads=<number>] [--events=<number>]', end=' ')
+    print('[--locks=<number>] [--cpus=<number>] [--churn=<probability>]',
+          end=' ')
+    print('[--seed=<number>]]', end=' ')
+    print()
+
+
+def main():
+    try:
+        opts, args = getopt.getopt(sys.argv[1:], 't:',
+                ['trace=', 'encoding=', 'slots=', 'generate', 'threads=',
+                 'events=', 'locks=', 'cpus=', 'churn=', 'seed=', 'vc-cache=',
+                 'vc-cache-size=', 'flush', 'clock-bits='])
+    except:
+        print_usage()
+        sys.exit(1)
+
+    trace_path = None
+    encodings = ['current', 'compact']
+    slots = '4'
+    generate = False
+    threads = '16'
+    events = '1000000'
+    locks = '8'
+    cpus = '8'
+    seed = '0'
+    vc_cache = None
+    vc_cache_size = '64'
+    churn = '0'
+    flush = False
+    clock_bits = None
+
+    for opt, arg in opts:
+        if opt in ('-t', '--trace'):
+            trace_path = arg
+        elif opt == '--encoding':
+            encodings = arg.split(',')
+        elif opt == '--slots':
+            slots = arg
+        elif opt == '--generate':
+            generate = True
+        elif opt == '--threads':
+            threads = arg
+        elif opt == '--events':
+            events = arg
+        elif opt == '--locks':
+            locks = arg
+        elif opt == '--cpus':
+            cpus = arg
+        elif opt == '--seed':
+            seed = arg
+        elif opt == '--vc-cache':
+            vc_cache = arg.split(',')
+        elif opt == '--vc-cache-size':
+            vc_cache_size = arg
+        elif opt == '--churn':
+            churn = arg
+        elif opt == '--flush':
+            flush = True
+        elif opt == '--clock-bits':
+            clock_bits = arg
+
+    try:
+        slots = int(slots)
+        threads = int(threads)
+        events = int(events)
+        locks = int(locks)
+        cpus = int(cpus)
+        seed = int(seed)
+        vc_cache_size = int(vc_cache_size)
+        churn = float(churn)
+        encodings = [ENCODINGS[encoding] for encoding in encodings]
+    except:
+        print_usage()
+        sys.exit(1)
+
+    if trace_path == None:
+        print_usage()
+        sys.exit(1)
+
+    if generate:
+        generate_trace(trace_path, threads, events, locks, cpus, churn, seed)
+        sys.exit(0)
+
+    # Narrower clocks overflow sooner, which makes flushes easy to study on
+    # short traces.
+    if flush:
+        encoding = encodings[-1]
+        if clock_bits != None:
+            encoding = Encoding(encoding.name, encoding.slot_size,
+                                encoding.tid_bits, int(clock_bits))
+        benchmark_flush(read_trace(trace_path), encoding, slots)
+        sys.exit(0)
+
+    if vc_cache != None:
+        benchmark_vc_cache(read_trace(trace_path), vc_cache, slots,
+                           vc_cache_size)
+        sys.exit(0)
+
+    benchmark(read_trace(trace_path), encodings, slots)
+    sys.exit(0)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,387 @@
+#!/usr/bin/env python
+
+# Tool for finding struct fields that are accessed both with and without
+# READ_ONCE/WRITE_ONCE in a kernel source tree. Such fields are likely
+# accessed concurrently, so their plain accesses are data races that hide
+# other races from KCSAN (see other/READ_WRITE_ONCE.md).
+#
+# The scan is lexical: comments, strings and preprocessor directives are
+# dropped, and field accesses are attributed to a struct type when the base
+# variable is declared as 'struct <type>' in the same file. Results are
+# cached per file, so that rescans only look at changed files.
+
+from __future__ import print_function
+from collections import defaultdict
+import bisect
+import getopt
+import hashlib
+import multiprocessing
+import os
+import pickle
+import re
+import sys
+import tempfile
+
+# Macros that mark an access as intentionally concurrent. For the ones
+# listed in STORE_ANNOTATIONS, only the first argument is the marked access.
+# This also matches the __READ_ONCE and __WRITE_ONCE variants. Regexes here
+# don't start with \b, as it makes them several times slower.
+ANNOTATION_RE = re.compile(
+    r'(?P<macro>READ_ONCE|WRITE_ONCE|smp_load_acquire|smp_store_release|' +
+    r'data_race)\s*\('
+)
+STORE_ANNOTATIONS = ('WRITE_ONCE', 'smp_store_release')
+
+# Matches comments, string and character literals, and preprocessor lines.
+NOISE_RE = re.compile(
+    r'//[^\n]*|/\*.*?\*/|"(\\.|[^"\\\n])*"|' +
+    r"'(\\.|[^'\\\n])*'|^[ \t]*#[^\n]*",
+    re.S | re.M
+)
+
+# Matches a field access, e.g. '->itty' or '.flags'.
+FIELD_RE = re.compile(
+    r'(?P<op>->|\.)\s*(?P<field>[A-Za-z_]\w*)'
+)
+
+# Matches the variable a field is accessed through, e.g. 'port' in
+# 'port->itty', when searched for right before the field access. Looking
+# back is much faster than making the base optional in FIELD_RE.
+BASE_RE = re.compile(
+    r'\b(?P<base>[A-Za-z_]\w*)\s*$'
+)
+BASE_LOOKBACK = 64
+
+# Matches declarations of struct variables and pointers, e.g.
+# 'struct tty_port *port;' or 'const struct foo *a, '.
+DECL_RE = re.compile(
+    r'struct\s+(?P<type>\w+)\s*(?:\*\s*|const\s+)*(?P<var>[A-Za-z_]\w*)' +
+    r'\s*[;,=)\[]'
+)
+
+WORD_RE = re.compile(r'\w')
+
+# Matches what follows a written field.
+WRITE_RE = re.compile(
+    r'\s*(=(?!=)|[-+*/%&|^]=|<<=|>>=|\+\+|--)'
+)
+
+# Matches a source location in a symbolized report, e.g. 'mm/slub.c:123'.
+FILELINE_RE = re.compile(
+    r'(?P<file>[\w./+-]+\.[ch]):(?P<line>[0-9]+)'
+)
+
+# Bumped when the format of cached scan results changes.
+CACHE_VERSION = 1
+
+# Access flags stored in scan results.
+ANNOTATED = 1
+WRITE = 2
+
+
+def blank(match):
+    # Keep newlines, so that line numbers don't change.
+    return ' ' + '\n' * match.group(0).count('\n')
+
+
+def find_call_end(text, start, first_arg):
+    """Returns the end of the call whose argument list starts at |start|.
+    If |first_arg| is set, returns the end of the first argument instead.
+    """
+    depth = 0
+    for i in range(start, len(text)):
+        c = text[i]
+        if c in '([{':
+            depth += 1
+        elif c in ')]}':
+            depth -= 1
+            if depth == 0:
+                return i
+        elif c == ',' and depth == 1 and first_arg:
+            return i
+    return len(text)
+
+
+def scan_text(text):
+    """Returns a list of (key, line, flags) for field accesses in |text|.
+
+    Keys are '<struct>.<field>', or '?.<field>' when the struct is unknown.
+    """
+    text = NOISE_RE.sub(blank, text)
+
+    line_starts = [0]
+    for match in re.finditer('\n', text):
+        line_starts.append(match.end())
+
+    annotated = bytearray(len(text))
+    for match in ANNOTATION_RE.finditer(text):
+        start = match.end() - 1
+        end = find_call_end(text, start,
+                            match.group('macro') in STORE_ANNOTATIONS)
+        annotated[start:end] = b'\x01' * (end - start)
+
+    types = {}
+    for match in DECL_RE.finditer(text):
+        if match.start() > 0 and WORD_RE.match(text, match.start() - 1):
+            continue
+        types[match.group('var')] = match.group('type')
+
+    accesses = []
+    for match in FIELD_RE.finditer(text):
+        start = match.start()
+        base = BASE_RE.search(text, max(0, start - BASE_LOOKBACK), start)
+        if base != None:
+            base = base.group('base')
+        elif match.group('op') == '.':
+            # A designated initializer or a member of an expression.
+            continue
+        key = '%s.%s' % (types.get(base, '?'), match.group('field'))
+        flags = 0
+        if annotated[match.start('field')]:
+            flags |= ANNOTATED
+        if WRITE_RE.match(text, match.end()):
+            flags |= WRITE
+        line = bisect.bisect_right(line_starts, match.start('field'))
+        accesses.append((key, line, flags))
+    return accesses
+
+
+# Content hashes with cached results. Set before the worker pool is forked.
+known_digests = set()
+
+
+def scan_file(path):
+    """Returns (path, content hash, accesses). Accesses are None if the
+    content hash is already known, and the hash is None on read errors.
+    """
+    try:
+        with open(path, 'rb') as f:
+            data = f.read()
+    except (IOError, OSError):
+        return (path, None, None)
+    digest = hashlib.sha1(data).hexdigest()
+    if digest in known_digests:
+        return (path, digest, None)
+    return (path, digest, scan_text(data.decode('latin-1')))
+
+
+def source_files(tree):
+    for root, dirs, files in os.walk(tree):
+        dirs[:] = [d for d in dirs if not d.startswith('.')]
+        for f in files:
+            if f.endswith('.c') or f.endswith('.h'):
+                yield os.path.join(root, f)
+
+
+class ScanCache(object):
+    """Scan results keyed by file content hash.
+
+    Files are also remembered by path, size and modification time, so that
+    unchanged files don't even have to be read again.
+    """
+    def __init__(self, path):
+        self.path = path
+        self.files = {}
+        self.results = {}
+        if path != None and os.path.exists(path):
+            with open(path, 'rb') as f:
+                state = pickle.load(f)
+            if state.get('version') == CACHE_VERSION:
+                self.files = state['files']
+                self.results = state['results']
+
+    def lookup(self, path):
+        """Returns the content hash of |path| if it is known to be unchanged.
+        """
+        stat = os.stat(path)
+        entry = self.files.get(path)
+        if entry == None or entry[:2] != (stat.st_mtime, stat.st_size):
+            return None
+        if entry[2] not in self.results:
+            return None
+        return entry[2]
+
+    def save(self, files, results):
+        if self.path == None:
+            return
+        # Only keep what this run has seen, so the cache doesn't grow.
+        fd, tmp_path = tempfile.mkstemp(
+                dir=os.path.dirname(os.path.abspath(self.path)))
+        with os.fdopen(fd, 'wb') as f:
+            pickle.dump({
+                'version': CACHE_VERSION,
+                'files': files,
+                'results': results,
+            }, f, pickle.HIGHEST_PROTOCOL)
+        os.rename(tmp_path, self.path)
+
+
+def scan_tree(tree, cache, jobs):
+    """Returns {relative path: accesses} for all source files in |tree|, and
+    the number of files that had to be scanned.
+    """
+    files = {}
+    results = {}
+    digests = {}
+    todo = []
+    for path in source_files(tree):
+        digest = cache.lookup(path)
+        if digest != None:
+            digests[path] = digest
+            results[digest] = cache.results[digest]
+        else:
+            todo.append(path)
+
+    # Files that were touched but have known contents (e.g. after switching
+    # branches back and forth) are hashed in the workers but not scanned.
+    global known_digests
+    known_digests = set(cache.results)
+    if jobs > 1 and len(todo) > 1:
+        pool = multiprocessing.Pool(jobs)
+        scanned = pool.imap_unordered(scan_file, todo, 64)
+    else:
+        pool = None
+        scanned = (scan_file(path) for path in todo)
+    rescanned = 0
+    for path, digest, accesses in scanned:
+        if digest == None:
+            continue
+        digests[path] = digest
+        if accesses == None:
+            accesses = cache.results[digest]
+        else:
+            rescanned += 1
+        results[digest] = accesses
+    if pool != None:
+        pool.close()
+        pool.join()
+
+    for path, digest in digests.items():
+        stat = os.stat(path)
+        files[path] = (stat.st_mtime, stat.st_size, digest)
+    cache.save(files, results)
+
+    return dict((os.path.relpath(path, tree), results[digest])
+                for (path, digest) in digests.items()), rescanned
+
+
+def load_kcsan_locations(paths, source_paths):
+    """Returns the (path, line) pairs mentioned in symbolized KCSAN reports,
+    with paths made relative to the scanned tree.
+    """
+    locations = set()
+    for path in paths:
+        with open(path) as f:
+            for line in f:
+                for match in FILELINE_RE.finditer(line):
+                    file = match.group('file').lstrip('./')
+                    parts = file.split('/')
+                    for i in range(len(parts)):
+                        suffix = '/'.join(parts[i:])
+                        if suffix in source_paths:
+                            locations.add((suffix, int(match.group('line'))))
+                            break
+    return locations
+
+
+def find_mixed_fields(scan, untyped):
+    """Returns {key: (annotated count, [(path, line, flags)])} for fields
+    with both annotated and plain accesses.
+    """
+    annotated = defaultdict(int)
+    plain = defaultdict(list)
+    for path, accesses in scan.items():
+        for key, line, flags in accesses:
+            if not untyped and key.startswith('?.'):
+                continue
+            if flags & ANNOTATED:
+                annotated[key] += 1
+            else:
+                plain[key].append((path, line, flags))
+    return dict((key, (annotated[key], plain[key]))
+                for key in annotated if key in plain)
+
+
+def print_fields(fields, kcsan):
+    """Prints fields with the ones whose plain accesses show up in KCSAN
+    reports first, then by the number of plain accesses.
+    """
+    kcsan_files = set(path for (path, line) in kcsan)
+
+    def priority(key):
+        count, accesses = fields[key]
+        in_reports = sum(1 for (path, line, flags) in accesses
+                         if (path, line) in kcsan)
+        in_files = sum(1 for (path, line, flags) in accesses
+                       if path in kcsan_files)
+        return (in_reports, in_files, len(accesses))
+
+    for key in sorted(fields, key=priority, reverse=True):
+        count, accesses = fields[key]
+        in_reports = priority(key)[0]
+        print('%s: %d annotated, %d plain%s' % (key, count, len(accesses),
+              ', %d in KCSAN reports' % in_reports if in_reports else ''))
+        for path, line, flags in sorted(accesses):
+            print('    %s:%d %s%s' % (path, line,
+                  'write' if flags & WRITE else 'read',
+                  ' [KCSAN]' if (path, line) in kcsan else ''))
+
+
+def print_usage():
+    print('Usage: {0} --tree=<kernel source path>'.format(sys.argv[0]),
+          end=' ')
+    print('[--cache=<cache path>]', end=' ')
+    print('[--kcsan=<symbolized KCSAN reports path>]', end=' ')
+    print('[--jobs=<number>]', end=' ')
+    print('[--untyped]', end=' ')
+    print()
+
+
+def main():
+    try:
+        opts, args = getopt.getopt(sys.argv[1:], 't:j:',
+                ['tree=', 'cache=', 'kcsan=', 'jobs=', 'untyped'])
+    except:
+        print_usage()
+        sys.exit(1)
+
+    tree = None
+    cache_path = os.path.expanduser('~/.cache/once_scanner.pickle')
+    kcsan_paths = []
+    jobs = multiprocessing.cpu_count()
+    untyped = False
+
+    for opt, arg in opts:
+        if opt in ('-t', '--tree'):
+            tree = arg
+        elif opt == '--cache':
+            cache_path = arg
+        elif opt == '--kcsan':
+            kcsan_paths.append(arg)
+        elif opt in ('-j', '--jobs'):
+            try:
+                jobs = int(arg)
+            except ValueError:
+                print_usage()
+                sys.exit(1)
+        elif opt == '--untyped':
+            untyped = True
+
+    if tree == None:
+        print_usage()
+        sys.exit(1)
+
+    cache_dir = os.path.dirname(os.path.abspath(cache_path))
+    if not os.path.isdir(cache_dir):
+        os.makedirs(cache_dir)
+
+    scan, rescanned = scan_tree(tree, ScanCache(cache_path), jobs)
+    kcsan = load_kcsan_locations(kcsan_paths, scan)
+    print_fields(find_mixed_fields(scan, untyped), kcsan)
+    print('%d files, %d scanned' % (len(scan), rescanned), file=sys.stderr)
+
+    sys.exit(0)
+
+
+if __name__ == '__main__':
+    main()
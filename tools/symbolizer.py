@@ -5,11 +5,24 @@
 
 from __future__ import print_function
 from collections import defaultdict
+import bisect
+import fcntl
 import getopt
+import hashlib
+import io
+import json
+import mmap
+import multiprocessing
 import os
 import re
+import socket
+import struct
 import sys
 import subprocess
+import tempfile
+import threading
+import time
+import zlib
 
 # Matches the timestamp or a thread/cpu number prefix of a log line.
 BRACKET_PREFIX_RE = re.compile(
@@ -75,6 +88,148 @@ KSAN_RE = re.compile(
     '$'
 )
 
+# Matches a frame that the kernel could not symbolize and printed as a raw
+# address, e.g.:
+#  [<ffffffffc0123456>] 0xffffffffc0123456
+#  ? 0xffffffffc0123456
+FRAME_RAW_RE = re.compile(
+    r'^' +
+    r'(?P<prefix> *)' +
+    FRAME_ADDR_RE + r'?' +
+    r'((?P<precise>\?) )?' +
+    r'(?P<body>0x(?P<raw>' + HEXNUM_RE + r'))' +
+    r'$'
+)
+
+# Matches the 'lr :' and 'pc :' lines with raw addresses.
+LR_RAW_RE = re.compile(
+    '^' +
+    '(?P<prefix>(?P<reg>lr|pc) : )' +
+    '(?P<body>(0x)?(?P<raw>' + HEXNUM_RE + '))' +
+    '$'
+)
+
+# Matches a line of a register dump, e.g.:
+# x29: ffff80001234fd80 x28: f2ff000003e5a000
+# RAX: ffffffffffffffda RBX: 00007ffd2d2a4c50 RCX: 00007f2d3e8f2f59
+REGS_RE = re.compile(
+    '^ *([A-Za-z][A-Za-z0-9]* ?: [0-9a-f]{16} *)+$'
+)
+
+# Matches a single register in a register dump line.
+REG_RE = re.compile(
+    '(?P<reg>[A-Za-z][A-Za-z0-9]*) ?: (?P<value>[0-9a-f]{16})'
+)
+
+# Matches the KASLR offset printed on panic, e.g.:
+# Kernel Offset: 0x1d000000 from 0xffffffff81000000 (relocation range: ...)
+KERNEL_OFFSET_RE = re.compile(
+    '^Kernel Offset: ((0x(?P<offset>' + HEXNUM_RE + ') from)|disabled)'
+)
+
+# Matches the bad access description in KASAN reports.
+ACCESS_RE = re.compile(
+    '^(Read|Write) of size ' + DECNUM_RE +
+    ' at addr (?P<addr>' + HEXNUM_RE + ')'
+)
+
+# Matches the tag mismatch description in tag-based KASAN reports.
+TAG_RE = re.compile(
+    r'^Pointer tag: \[(?P<ptr_tag>' + HEXNUM_RE + r')\], ' +
+    r'memory tag: \[(?P<mem_tag>' + HEXNUM_RE + r')\]$'
+)
+
+# Matches the header of KFENCE reports.
+KFENCE_RE = re.compile(
+    '^BUG: KFENCE: (?P<bug>.+?) in '
+)
+
+# Matches the bad access description in KFENCE reports, e.g.:
+# Out-of-bounds read at 0xffff8c3f2e291fff (1B left of kfence-#72):
+# Use-after-free read at 0xffff8c3f2e2a0000 (in kfence-#79):
+# Corrupted memory at 0xffff8c3f2e2ae01f [ 0xac . . . ] (in kfence-#81):
+# Invalid free of 0xffff8c3f2e2b0000 (in kfence-#83):
+KFENCE_ACCESS_RE = re.compile(
+    r'^(?P<access>.+) (at|of) 0x(?P<addr>' + HEXNUM_RE + r')' +
+    r'( \[[^\]]*\])?' +
+    r'( \((?P<distance>' + DECNUM_RE + r')B (?P<direction>left|right) ' +
+        r'of kfence-#(?P<index>' + DECNUM_RE + r')\)' +
+    r'| \(in kfence-#(?P<in_index>' + DECNUM_RE + r')\))?' +
+    r':$'
+)
+
+# Matches the KFENCE object description, e.g.:
+# kfence-#72: 0xffff8c3f2e292000-0xffff8c3f2e29201f, size=32, cache=kmalloc-32
+KFENCE_OBJECT_RE = re.compile(
+    '^kfence-#(?P<index>' + DECNUM_RE + '): ' +
+    '0x(?P<start>' + HEXNUM_RE + ')-0x(?P<end>' + HEXNUM_RE + '), ' +
+    'size=(?P<size>' + DECNUM_RE + '), cache=(?P<cache>[^ ]+)'
+)
+
+# Matches the allocation and deallocation stack headers in KFENCE reports.
+KFENCE_ALLOC_RE = re.compile(
+    r'^(?P<kind>allocated|freed) by task (?P<pid>' + DECNUM_RE + r') ' +
+    r'on cpu (?P<cpu>' + DECNUM_RE + r') at (?P<time>[0-9\.]+)s'
+)
+
+# Matches the header of lockdep reports.
+LOCKDEP_RE = re.compile(
+    '^WARNING: (?P<bug>possible circular locking dependency detected|' +
+    'possible recursive locking detected|inconsistent lock state|' +
+    'possible irq lock inversion dependency detected|' +
+    '[A-Z]+-safe -> [A-Z]+-unsafe lock order detected|' +
+    'bad unlock balance detected!|held lock freed!)'
+)
+
+# Matches a lock and the location it was taken at in lockdep reports, e.g.:
+# ffff888012345678 (&mm->mmap_lock){++++}-{3:3}, at: foo+0x11/0x1a
+#  #0: ffff888012345678 (&lock){+.+.}-{3:3}, at: bar+0xa/0x1c
+LOCKDEP_LOCK_RE = re.compile(
+    r'^(?P<prefix>' +
+        r'( *#(?P<held>' + DECNUM_RE + r'): )?' +
+        r'(' + HEXNUM_RE + r' )?' +
+        r'\((?P<lock>.+)\)(?P<state>[^ ]*), at: ' +
+    r')' +
+    FRAME_BODY_RE +
+    r'$'
+)
+
+# Matches the header of a dependency in lockdep reports, which is followed by
+# the stack that recorded the dependency, e.g.:
+# -> #1 (&lock){+.+.}-{3:3}:
+LOCKDEP_CHAIN_RE = re.compile(
+    r'^-> #(?P<index>' + DECNUM_RE + r') \((?P<lock>.+)\)[^ ]*:$'
+)
+
+# Matches the line that separates sanitizer reports from the rest of the log.
+REPORT_END_RE = re.compile(
+    '^=+$'
+)
+
+# Maximum number of lines kept for a single report before it is flushed.
+MAX_REPORT_LINES = 10000
+
+# Matches the first line of a kernel report, used to find report boundaries.
+REPORT_START_RE = re.compile(
+    '^(BUG: |WARNING: |INFO: |Unable to handle kernel |' +
+    'general protection fault)'
+)
+
+# Matches the markers around stacks of different contexts, e.g. <TASK>.
+STACK_MARKER_RE = re.compile(
+    '^ *</?(TASK|IRQ|EOI|NMI|SOFTIRQ)>$'
+)
+
+# Matches the marker that closes the stack of the current task.
+TASK_END_RE = re.compile(
+    r'^ *</TASK>$'
+)
+
+# Matches the address of a frame together with the space that follows it.
+FRAME_ADDR_PREFIX_RE = re.compile(
+    FRAME_ADDR_RE
+)
+
 # Matches a single relevant line of `readelf -Ws` output.
 READELF_RE = re.compile(
     '^[ ]*' +
@@ -88,6 +243,58 @@ READELF_RE = re.compile(
     '(?P<symbol>[^ ]+)$'
 )
 
+# Matches a row of `readelf --debug-dump=decodedline` output. The line is
+# '-' for rows that end a sequence of instructions.
+LINE_TABLE_RE = re.compile(
+    '^(?P<file>[^ ]+)[ ]+' +
+    '(?P<line>' + DECNUM_RE + '|-)[ ]+' +
+    '0x(?P<addr>' + HEXNUM_RE + ')'
+)
+
+# Match symbols and sections in `readelf -W -S -s` output, regardless of
+# their type or visibility.
+READELF_BOUNDS_RE = re.compile(
+    '^[ ]*' + DECNUM_RE + ':[ ]+' +
+    '(?P<start>' + HEXNUM_RE + ')[ ]+' +
+    '(?P<size>' + DECNUM_RE + ')[ ]'
+)
+READELF_SECTION_RE = re.compile(
+    '^[ ]*\\[[ ]*' + DECNUM_RE + '\\][ ]+[^ ]+[ ]+[^ ]+[ ]+' +
+    '(?P<start>' + HEXNUM_RE + ')[ ]+' + HEXNUM_RE + '[ ]+' +
+    '(?P<size>' + HEXNUM_RE + ')[ ]'
+)
+
+# With tag-based KASAN on arm64, the top byte of a pointer holds a tag that is
+# ignored by the hardware. Bit 55 selects between the kernel and user halves
+# of the address space, so a canonical address has the top byte filled with
+# copies of that bit. Already canonical x86-64 addresses are not affected.
+TAG_SHIFT = 56
+TAG_MASK = 0xff << TAG_SHIFT
+ADDR_MASK = (1 << TAG_SHIFT) - 1
+KERNEL_BIT = 1 << 55
+
+
+def canonicalize_addr(addr):
+    if addr & KERNEL_BIT:
+        return addr | TAG_MASK
+    return addr & ADDR_MASK
+
+
+def canonicalize_addrs(addrs):
+    """Canonicalizes a batch of addresses.
+
+    Kernel and user addresses are split by a single comparison against the
+    sign bit and fixed up with one mask each.
+    """
+    tag_mask, addr_mask, kernel_bit = TAG_MASK, ADDR_MASK, KERNEL_BIT
+    return [(addr | tag_mask) if addr & kernel_bit else (addr & addr_mask)
+            for addr in addrs]
+
+
+# Maximum number of addresses sent to addr2line at once.
+BATCH_SIZE = 32
+
+
 class Symbolizer(object):
     def __init__(self, binary_path):
         self.proc = subprocess.Popen(
@@ -104,7 +311,25 @@ class Symbolizer(object):
         self.proc.stdin.write((addr + '\n').encode('ascii'))
         self.proc.stdin.write(('ffffffffffffffff\n').encode('ascii'))
         self.proc.stdin.flush()
-
+        return self.read_result()
+
+    def process_batch(self, addrs):
+        """Symbolizes several addresses with one round-trip per chunk.
+
+        Addresses are sent in chunks, so that addr2line never blocks on
+        writing a full output pipe while we are still writing its input.
+        """
+        results = []
+        for i in range(0, len(addrs), BATCH_SIZE):
+            chunk = addrs[i:i + BATCH_SIZE]
+            request = ''.join(addr + '\nffffffffffffffff\n' for addr in chunk)
+            self.proc.stdin.write(request.encode('ascii'))
+            self.proc.stdin.flush()
+            for addr in chunk:
+                results.append(self.read_result())
+        return results
+
+    def read_result(self):
         result = []
         while True:
             func = self.proc.stdout.readline().decode('ascii').rstrip()
@@ -121,6 +346,181 @@ class Symbolizer(object):
         self.proc.wait()
 
 
+class GitSource(object):
+    """Source files served from a git object store.
+
+    Instead of reading source files from a checked out tree, blobs are
+    requested as '<commit>:<path>' from a single `git cat-file --batch`
+    process running against a local (possibly bare) repository. Blobs are
+    cached by their object id, so identical file contents are only read once.
+    """
+    def __init__(self, git_dir, commit):
+        self.commit = commit
+        self.path_oids = {}
+        self.blobs = {}
+        self.proc = subprocess.Popen(
+            ['git', '--git-dir=' + git_dir, 'cat-file', '--batch'],
+            stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, type, value, traceback):
+        self.close()
+
+    def read(self, path):
+        if path in self.path_oids:
+            oid = self.path_oids[path]
+            return self.blobs.get(oid)
+
+        self.proc.stdin.write(
+            ('%s:%s\n' % (self.commit, path)).encode('utf-8'))
+        self.proc.stdin.flush()
+
+        # The header is '<oid> <type> <size>' or '<object> missing'.
+        header = self.proc.stdout.readline().decode('utf-8').split()
+        if len(header) != 3:
+            self.path_oids[path] = None
+            return None
+        oid, type, size = header[0], header[1], int(header[2])
+        content = self.proc.stdout.read(size)
+        self.proc.stdout.read(1) # trailing newline
+
+        self.path_oids[path] = oid
+        if type != 'blob':
+            return None
+        if oid not in self.blobs:
+            self.blobs[oid] = \
+                content.decode('utf-8', 'replace').splitlines(True)
+        return self.blobs[oid]
+
+    def close(self):
+        self.proc.stdin.close()
+        self.proc.wait()
+
+
+# Matches the first line of a block in `git blame --incremental` output.
+BLAME_BLOCK_RE = re.compile(
+    r'^(?P<commit>[0-9a-f]{40,64}) (?P<orig>[0-9]+) (?P<final>[0-9]+) ' +
+    r'(?P<count>[0-9]+)$'
+)
+
+# Commit headers in `git blame --incremental` output that are attached to
+# blamed lines.
+BLAME_HEADERS = ['author', 'author-mail', 'author-time', 'summary']
+
+# Number of structured records that are attributed to commits at once.
+BLAME_BATCH_RECORDS = 100
+
+# Number of frames at the top of each stack that are attributed to commits.
+BLAME_FRAMES = 3
+
+
+class GitBlame(object):
+    """Last commits touching source lines, found with `git blame`.
+
+    Lines are blamed in batches, with a single `git blame --incremental` run
+    per file covering all lines requested from that file. Results are cached
+    by (commit, file, line), and stored in the cache directory if there is
+    one.
+    """
+    def __init__(self, git_dir, commit, source, cache_dir=None):
+        self.git_dir = git_dir
+        # Resolve the commit, so that cached results stay valid when a
+        # branch moves.
+        self.commit = subprocess.check_output(
+            ['git', '--git-dir=' + git_dir, 'rev-parse', '--verify',
+             commit + '^{commit}']).decode('utf-8').strip()
+        self.source = source
+        self.lines = {}
+        self.new_lines = False
+        self.path = None
+        if cache_dir != None:
+            self.path = os.path.join(cache_dir, 'blame-%s.json' % self.commit)
+            if os.path.exists(self.path):
+                with open(self.path) as f:
+                    self.lines = json.load(f)
+
+    def lookup(self, path, line):
+        return self.lines.get('%s:%d' % (path, line))
+
+    def blame(self, locations):
+        """Blames all (path, line) pairs in |locations| not blamed yet."""
+        missing = defaultdict(set)
+        for path, line in locations:
+            if '%s:%d' % (path, line) not in self.lines:
+                missing[path].add(line)
+        for path, lines in missing.items():
+            self.blame_file(path, sorted(lines))
+
+    def blame_file(self, path, lines):
+        self.new_lines = True
+        for line in lines:
+            self.lines['%s:%d' % (path, line)] = None
+
+        # `git blame` fails altogether if any range is past the end of file.
+        content = self.source.read(path)
+        if content == None:
+            return
+        lines = [line for line in lines if 0 < line <= len(content)]
+        if not lines:
+            return
+
+        args = ['git', '--git-dir=' + self.git_dir, 'blame', '--incremental']
+        start = end = lines[0]
+        for line in lines[1:] + [None]:
+            if line == end + 1:
+                end = line
+                continue
+            args += ['-L', '%d,%d' % (start, end)]
+            start = end = line
+        args += [self.commit, '--', path]
+        try:
+            with open(os.devnull, 'w') as devnull:
+                output = subprocess.check_output(args, stderr=devnull)
+        except (OSError, subprocess.CalledProcessError):
+            return
+
+        # Commit headers are only printed for the first block of a commit.
+        commits = {}
+        line_commits = {}
+        block = None
+        for line in output.decode('utf-8', 'replace').splitlines():
+            match = BLAME_BLOCK_RE.match(line)
+            if match:
+                block = match
+                commit = match.group('commit')
+                if commit not in commits:
+                    commits[commit] = {'commit': commit}
+                continue
+            if block == None:
+                continue
+            header = line.split(' ', 1)
+            if header[0] in BLAME_HEADERS and len(header) == 2:
+                key = header[0].replace('-', '_')
+                commits[block.group('commit')][key] = header[1]
+            elif header[0] == 'filename':
+                final = int(block.group('final'))
+                for i in range(int(block.group('count'))):
+                    line_commits[final + i] = block.group('commit')
+                block = None
+
+        for line in lines:
+            if line in line_commits:
+                self.lines['%s:%d' % (path, line)] = \
+                    commits[line_commits[line]]
+
+    def save(self):
+        if self.path == None or not self.new_lines:
+            return
+        fd, tmp_path = tempfile.mkstemp(dir=os.path.dirname(self.path))
+        with os.fdopen(fd, 'w') as f:
+            json.dump(self.lines, f)
+        os.chmod(tmp_path, 0o644)
+        os.rename(tmp_path, self.path)
+        self.new_lines = False
+
+
 def find_file(path, name, prefix=False):
     path = os.path.expanduser(path)
     best_match = None
@@ -195,19 +595,785 @@ class SymbolOffsetTable(object):
         return offsets[size]
 
 
+class MappedTable(object):
+    """A read-only table mapping byte string keys to byte string values.
+
+    The table is stored in a file that is mmap'ed on load, so several
+    processes that load the same table share a single copy of it in the page
+    cache instead of each building their own.
+
+    The file starts with a header (magic, number of entries), followed by an
+    index of (key offset, key length, value offset, value length) entries
+    sorted by key, followed by the keys and values themselves. Lookups do a
+    binary search over the index.
+    """
+    MAGIC = b'KSYMTAB1'
+    HEADER = struct.Struct('<8sI')
+    ENTRY = struct.Struct('<IIII')
+
+    def __init__(self, path):
+        with open(path, 'rb') as f:
+            self.data = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+            self.stat = os.fstat(f.fileno())
+        magic, self.count = self.HEADER.unpack_from(self.data, 0)
+        if magic != self.MAGIC:
+            raise ValueError('bad table file: %s' % path)
+
+    def entry(self, i):
+        return self.ENTRY.unpack_from(self.data,
+                self.HEADER.size + i * self.ENTRY.size)
+
+    def key(self, i):
+        key_off, key_len, _, _ = self.entry(i)
+        return self.data[key_off:key_off + key_len]
+
+    def value(self, i):
+        _, _, value_off, value_len = self.entry(i)
+        return self.data[value_off:value_off + value_len]
+
+    def find(self, key):
+        """Returns the index of |key|, or None if it is not in the table."""
+        lo, hi = 0, self.count
+        while lo < hi:
+            mid = (lo + hi) // 2
+            if self.key(mid) < key:
+                lo = mid + 1
+            else:
+                hi = mid
+        if lo < self.count and self.key(lo) == key:
+            return lo
+        return None
+
+    def get(self, key):
+        i = self.find(key)
+        if i == None:
+            return None
+        return self.value(i)
+
+    def items(self):
+        for i in range(self.count):
+            yield (self.key(i), self.value(i))
+
+    def close(self):
+        self.data.close()
+
+    @classmethod
+    def write(cls, path, items):
+        """Atomically writes a table with the given (key, value) pairs."""
+        items = sorted(items)
+        data_off = cls.HEADER.size + len(items) * cls.ENTRY.size
+        index = []
+        data = []
+        for key, value in items:
+            index.append(cls.ENTRY.pack(data_off, len(key),
+                                        data_off + len(key), len(value)))
+            data.append(key)
+            data.append(value)
+            data_off += len(key) + len(value)
+
+        # Write to a temporary file and rename it, so that concurrent readers
+        # never see a partially written table.
+        fd, tmp_path = tempfile.mkstemp(dir=os.path.dirname(path))
+        with os.fdopen(fd, 'wb') as f:
+            f.write(cls.HEADER.pack(cls.MAGIC, len(items)))
+            f.write(b''.join(index))
+            f.write(b''.join(data))
+        os.chmod(tmp_path, 0o644)
+        os.rename(tmp_path, path)
+
+
+class MappedSymbolOffsetTable(object):
+    """A SymbolOffsetTable stored in a MappedTable.
+
+    Keys are '<symbol> <size>', values are 8-byte offsets.
+    """
+    OFFSET = struct.Struct('<Q')
+
+    def __init__(self, path):
+        self.table = MappedTable(path)
+
+    @classmethod
+    def items(cls, offset_table):
+        items = []
+        for symbol, offsets in offset_table.offsets.items():
+            for size, offset in offsets.items():
+                key = ('%s %x' % (symbol, size)).encode('utf-8')
+                items.append((key, cls.OFFSET.pack(offset)))
+        return items
+
+    @classmethod
+    def write(cls, path, offset_table):
+        MappedTable.write(path, cls.items(offset_table))
+
+    def lookup_offset(self, symbol, size):
+        value = self.table.get(('%s %x' % (symbol, size)).encode('utf-8'))
+        if value is None:
+            return None
+        return self.OFFSET.unpack(value)[0]
+
+
+class FrameCache(object):
+    """Caches addr2line results for a single module.
+
+    If a path is given, previously saved results are loaded from it as a
+    MappedTable, and new results are merged into it by save(). Several
+    processes may share the path, so save() merges into whatever the file
+    holds at that time, under a lock, and then maps the merged file, which
+    also picks up results saved by the other processes.
+    Results found in the table are decoded on every lookup rather than kept,
+    so only results added since the last save take private memory.
+    Keys are module addresses, values are newline-separated frames, each a
+    tab-separated function name and fileline.
+    """
+    def __init__(self, path=None):
+        self.path = path
+        self.table = None
+        self.frames = {}
+        if path != None and os.path.exists(path):
+            self.map()
+
+    def map(self):
+        if self.table != None:
+            self.table.close()
+        self.table = MappedTable(self.path)
+
+    def lookup(self, addr):
+        if addr in self.frames:
+            return self.frames[addr]
+        if self.table == None:
+            return None
+        value = self.table.get(addr.encode('ascii'))
+        if value is None:
+            return None
+        frames = []
+        for frame in value.decode('utf-8').split('\n'):
+            if frame:
+                frames.append(tuple(frame.split('\t', 1)))
+        return frames
+
+    def add(self, addr, frames):
+        self.frames[addr] = frames
+
+    def save(self):
+        if self.path == None:
+            return
+        if not self.frames:
+            # Nothing to merge, but pick up what other processes saved.
+            # Saves replace the file, and the mapped one can't be reused
+            # for another file while it is mapped, so a different inode
+            # means a newer table.
+            try:
+                inode = os.stat(self.path).st_ino
+            except OSError:
+                return
+            if self.table == None or inode != self.table.stat.st_ino:
+                self.map()
+            return
+        with open(self.path + '.lock', 'a') as lock:
+            fcntl.flock(lock, fcntl.LOCK_EX)
+            items = {}
+            if os.path.exists(self.path):
+                table = MappedTable(self.path)
+                for key, value in table.items():
+                    items[key] = value
+                table.close()
+            for addr, frames in self.frames.items():
+                value = '\n'.join(func + '\t' + fileline
+                                  for (func, fileline) in frames)
+                items[addr.encode('ascii')] = value.encode('utf-8')
+            MappedTable.write(self.path, items.items())
+        self.map()
+        self.frames = {}
+
+
+SIDECAR_SUFFIX = '.sidecar'
+
+# Matches the fileline of an addr2line frame, split into the file, the line
+# and the discriminator.
+FILELINE_RE = re.compile(
+    '^(?P<file>.*):(?P<line>' + DECNUM_RE + ')' +
+    '( \\(discriminator (?P<discriminator>' + DECNUM_RE + ')\\))?$'
+)
+
+
+def readelf_lines(args, binary_path):
+    """Yields the output lines of readelf as it runs, without holding all of
+    it, which for the line table of vmlinux is gigabytes."""
+    proc = subprocess.Popen(['readelf', '-W'] + args + [binary_path],
+                            stdout=subprocess.PIPE)
+    for line in proc.stdout:
+        yield line.decode('utf-8', 'replace')
+    proc.stdout.close()
+    if proc.wait() != 0:
+        raise subprocess.CalledProcessError(proc.returncode, 'readelf')
+
+
+class Sidecar(MappedSymbolOffsetTable):
+    """Everything needed to symbolize frames of a binary, without the binary.
+
+    A sidecar is generated from a binary with debug info at build time. It
+    holds the symbol table, and the addr2line results for every row of the
+    line table and for the start and end of every symbol and section, which
+    covers code without debug info. The results for an address are the ones
+    for the closest row at or before it, as both the file:line and the
+    inlining context only change at row boundaries. Rows with the same
+    results as the row before are dropped.
+
+    The sidecar stands in for both the symbol table and the frame cache of
+    its binary, and addr2line is never started for it.
+
+    The file is a MappedTable with the symbols of a MappedSymbolOffsetTable.
+    Everything else is stored as packed arrays under keys that start with a
+    NUL byte, and so can't clash with symbols:
+    - the sorted row addresses, as offsets from a base address, and the
+      index of the frame set of each row;
+    - the frame sets, as the offset of each set in an array of frames, each
+      frame being the string index of the function and the file, the line
+      and the discriminator; the array is zlib-compressed in blocks of
+      SETS_PER_BLOCK sets, with the offset of each block;
+    - the strings, as the offset of each string in their concatenation.
+    Function names and paths repeat across most frames, so they are only
+    stored once. Lookups read the arrays in place and only inflate the block
+    they need, so the sidecar is shared in the page cache by all processes
+    that use it.
+    """
+    VERSION = 3
+    VERSION_KEY = b'\0version'
+    BASE_KEY = b'\0base'
+    ADDRS_KEY = b'\0addrs'
+    ROWS_KEY = b'\0rows'
+    SETS_KEY = b'\0sets'
+    BLOCKS_KEY = b'\0blocks'
+    FRAMES_KEY = b'\0frames'
+    STRING_OFFSETS_KEY = b'\0stroffs'
+    STRINGS_KEY = b'\0strings'
+    BASE = struct.Struct('<Q')
+    INDEX = struct.Struct('<I')
+    FRAME = struct.Struct('<IIII')
+    # Line of frames whose fileline doesn't match FILELINE_RE, such as
+    # '??:?'; the file string is then the whole fileline.
+    NO_LINE = 0xffffffff
+    SETS_PER_BLOCK = 64
+
+    def __init__(self, path):
+        MappedSymbolOffsetTable.__init__(self, path)
+        version = self.table.get(self.VERSION_KEY)
+        if version == None or self.INDEX.unpack(version)[0] != self.VERSION:
+            raise ValueError('bad sidecar file: %s' % path)
+        self.base = self.BASE.unpack(self.table.get(self.BASE_KEY))[0]
+        self.addrs_off, addrs_len = self.array(self.ADDRS_KEY)
+        self.rows_off, _ = self.array(self.ROWS_KEY)
+        self.sets_off, _ = self.array(self.SETS_KEY)
+        self.blocks_off, _ = self.array(self.BLOCKS_KEY)
+        self.frames_off, _ = self.array(self.FRAMES_KEY)
+        self.string_offsets_off, _ = self.array(self.STRING_OFFSETS_KEY)
+        self.strings_off, _ = self.array(self.STRINGS_KEY)
+        self.count = addrs_len // self.INDEX.size
+
+    def array(self, key):
+        _, _, value_off, value_len = self.table.entry(self.table.find(key))
+        return value_off, value_len
+
+    @classmethod
+    def write(cls, path, binary_path):
+        items = cls.items(SymbolOffsetTable(binary_path))
+
+        addrs = set()
+        for line in readelf_lines(['-S', '-s'], binary_path):
+            match = READELF_BOUNDS_RE.match(line)
+            if match != None:
+                size = int(match.group('size'))
+            else:
+                match = READELF_SECTION_RE.match(line)
+                if match == None:
+                    continue
+                size = int(match.group('size'), 16)
+            start = int(match.group('start'), 16)
+            addrs.add(start)
+            addrs.add(start + size)
+        for line in readelf_lines(['--debug-dump=decodedline'], binary_path):
+            match = LINE_TABLE_RE.match(line)
+            if match != None:
+                addrs.add(int(match.group('addr'), 16))
+        addrs = sorted(addrs)
+        base = addrs[0] if addrs else 0
+        if addrs and addrs[-1] - base > 0xffffffff:
+            raise ValueError('%s spans more than 4GB' % binary_path)
+
+        with Symbolizer(binary_path) as symbolizer:
+            results = symbolizer.process_batch(
+                    ['0x%x' % addr for addr in addrs])
+
+        strings = {}
+        def intern(string):
+            if string not in strings:
+                strings[string] = len(strings)
+            return strings[string]
+
+        frame_sets = {}
+        set_offsets = []
+        frames = []
+        row_addrs = []
+        rows = []
+        for addr, result in zip(addrs, results):
+            result = tuple(result)
+            if result not in frame_sets:
+                frame_sets[result] = len(frame_sets)
+                set_offsets.append(len(frames))
+                for func, fileline in result:
+                    match = FILELINE_RE.match(fileline)
+                    if match == None:
+                        frames.append(cls.FRAME.pack(intern(func),
+                                intern(fileline), cls.NO_LINE, 0))
+                        continue
+                    frames.append(cls.FRAME.pack(intern(func),
+                            intern(match.group('file')),
+                            int(match.group('line')),
+                            int(match.group('discriminator') or 0)))
+            if rows and rows[-1] == frame_sets[result]:
+                continue
+            row_addrs.append(addr - base)
+            rows.append(frame_sets[result])
+        set_offsets.append(len(frames))
+
+        block_offsets = [0]
+        blocks = []
+        for i in range(0, len(set_offsets) - 1, cls.SETS_PER_BLOCK):
+            end = set_offsets[min(i + cls.SETS_PER_BLOCK,
+                                  len(set_offsets) - 1)]
+            blocks.append(zlib.compress(b''.join(frames[set_offsets[i]:end])))
+            block_offsets.append(block_offsets[-1] + len(blocks[-1]))
+
+        string_offsets = [0]
+        data = []
+        for string in sorted(strings, key=strings.get):
+            data.append(string.encode('utf-8'))
+            string_offsets.append(string_offsets[-1] + len(data[-1]))
+
+        def pack(values):
+            return struct.pack('<%dI' % len(values), *values)
+        items.append((cls.VERSION_KEY, cls.INDEX.pack(cls.VERSION)))
+        items.append((cls.BASE_KEY, cls.BASE.pack(base)))
+        items.append((cls.ADDRS_KEY, pack(row_addrs)))
+        items.append((cls.ROWS_KEY, pack(rows)))
+        items.append((cls.SETS_KEY, pack(set_offsets)))
+        items.append((cls.BLOCKS_KEY, pack(block_offsets)))
+        items.append((cls.FRAMES_KEY, b''.join(blocks)))
+        items.append((cls.STRING_OFFSETS_KEY, pack(string_offsets)))
+        items.append((cls.STRINGS_KEY, b''.join(data)))
+        MappedTable.write(path, items)
+
+    def index(self, off, i):
+        return self.INDEX.unpack_from(self.table.data,
+                                      off + i * self.INDEX.size)[0]
+
+    def string(self, i):
+        start = self.index(self.string_offsets_off, i)
+        end = self.index(self.string_offsets_off, i + 1)
+        return self.table.data[self.strings_off + start:
+                               self.strings_off + end].decode('utf-8')
+
+    def lookup(self, addr):
+        addr = int(addr, 16) - self.base
+        lo, hi = 0, self.count
+        while lo < hi:
+            mid = (lo + hi) // 2
+            if self.index(self.addrs_off, mid) <= addr:
+                lo = mid + 1
+            else:
+                hi = mid
+        if lo == 0:
+            return []
+        row = self.index(self.rows_off, lo - 1)
+        block = row // self.SETS_PER_BLOCK
+        data = zlib.decompress(self.table.data[
+                self.frames_off + self.index(self.blocks_off, block):
+                self.frames_off + self.index(self.blocks_off, block + 1)])
+        block_start = self.index(self.sets_off, block * self.SETS_PER_BLOCK)
+        frames = []
+        for i in range(self.index(self.sets_off, row),
+                       self.index(self.sets_off, row + 1)):
+            func, path, line, discriminator = self.FRAME.unpack_from(
+                    data, (i - block_start) * self.FRAME.size)
+            fileline = self.string(path)
+            if line != self.NO_LINE:
+                fileline += ':%d' % line
+                if discriminator:
+                    fileline += ' (discriminator %d)' % discriminator
+            frames.append((self.string(func), fileline))
+        return frames
+
+    def add(self, addr, frames):
+        pass
+
+    def save(self):
+        pass
+
+
+def cache_file_prefix(cache_dir, binary_path):
+    # Name cache files after the binary and its identity, so that rebuilt
+    # binaries don't pick up stale caches.
+    stat = os.stat(binary_path)
+    identity = '%s:%d:%d' % (os.path.realpath(binary_path),
+                             stat.st_size, stat.st_mtime)
+    digest = hashlib.sha1(identity.encode('utf-8')).hexdigest()[:16]
+    return os.path.join(cache_dir,
+                        os.path.basename(binary_path) + '-' + digest)
+
+
+class KfenceReport(object):
+    """Structured fields of a KFENCE report.
+
+    Stacks are kept as the raw frame lines, so that they can be symbolized
+    together with the rest of the report.
+    """
+    def __init__(self, lines):
+        self.title = None
+        self.bug = None
+        self.access = None
+        self.addr = None
+        self.distance = None
+        self.direction = None
+        self.object = None
+        self.stacks = {'access': []}
+        self.tasks = {}
+
+        stack = None
+        for line in lines:
+            match = KFENCE_RE.match(line)
+            if match:
+                self.title = line[len('BUG: '):]
+                self.bug = match.group('bug')
+                continue
+            match = KFENCE_ACCESS_RE.match(line)
+            if match and self.access == None:
+                self.access = match.group('access')
+                self.addr = match.group('addr')
+                if match.group('distance') != None:
+                    self.distance = int(match.group('distance'))
+                    self.direction = match.group('direction')
+                    self.object = {'index': int(match.group('index'))}
+                elif match.group('in_index') != None:
+                    self.object = {'index': int(match.group('in_index'))}
+                stack = self.stacks['access']
+                continue
+            match = KFENCE_OBJECT_RE.match(line)
+            if match:
+                self.object = {
+                    'index': int(match.group('index')),
+                    'start': match.group('start'),
+                    'end': match.group('end'),
+                    'size': int(match.group('size')),
+                    'cache': match.group('cache'),
+                }
+                stack = None
+                continue
+            match = KFENCE_ALLOC_RE.match(line)
+            if match:
+                kind = match.group('kind')
+                self.tasks[kind] = {
+                    'pid': int(match.group('pid')),
+                    'cpu': int(match.group('cpu')),
+                    'time': float(match.group('time')),
+                }
+                self.stacks[kind] = []
+                stack = self.stacks[kind]
+                continue
+            if stack != None and FRAME_RE.match(line):
+                stack.append(line)
+            else:
+                stack = None
+
+    def record(self, symbolize):
+        """Returns the report as a dict, symbolizing stacks with |symbolize|.
+        """
+        record = {
+            'type': 'kfence',
+            'title': self.title,
+            'bug': self.bug,
+            'access': self.access,
+            'addr': self.addr,
+            'distance': self.distance,
+            'direction': self.direction,
+            'object': self.object,
+            'access_stack': [symbolize(line) for line in self.stacks['access']],
+        }
+        for kind, task in self.tasks.items():
+            task = dict(task)
+            task['stack'] = [symbolize(line) for line in self.stacks[kind]]
+            record[kind] = task
+        return record
+
+
+class LockdepReport(object):
+    """Structured fields of a lockdep report.
+
+    Stacks are kept as the raw frame lines, as in KfenceReport. So are the
+    lines with the locks involved, which tell where each lock was taken.
+    """
+    def __init__(self, lines):
+        self.title = None
+        self.bug = None
+        self.locks = {}
+        self.chain = []
+        self.held_locks = []
+        self.backtrace = []
+
+        expected = None
+        stack = None
+        for line in lines:
+            match = LOCKDEP_RE.match(line)
+            if match:
+                self.title = line[len('WARNING: '):]
+                self.bug = match.group('bug')
+                continue
+            if line.endswith(' is trying to acquire lock:'):
+                expected = 'acquiring'
+                continue
+            if line.endswith(' already holding lock:'):
+                expected = 'holding'
+                continue
+            match = LOCKDEP_LOCK_RE.match(line)
+            if match:
+                if match.group('held') != None:
+                    self.held_locks.append((match, line))
+                elif expected != None:
+                    self.locks[expected] = (match, line)
+                expected = None
+                continue
+            match = LOCKDEP_CHAIN_RE.match(line)
+            if match:
+                stack = []
+                self.chain.append((int(match.group('index')),
+                                   match.group('lock'), stack))
+                continue
+            if line == 'stack backtrace:':
+                stack = self.backtrace
+                continue
+            # The backtrace starts after a few lines about the task.
+            if stack != None and FRAME_RE.match(line):
+                stack.append(line)
+            elif stack is not self.backtrace:
+                stack = None
+
+    def record(self, symbolize):
+        """Returns the report as a dict, symbolizing stacks and lock
+        locations with |symbolize|.
+        """
+        def lock(match, line):
+            return {
+                'lock': match.group('lock'),
+                'state': match.group('state'),
+                'at': symbolize(line),
+            }
+
+        record = {
+            'type': 'lockdep',
+            'title': self.title,
+            'bug': self.bug,
+            'chain': [{
+                'index': index,
+                'lock': lock_name,
+                'stack': [symbolize(line) for line in stack],
+            } for (index, lock_name, stack) in self.chain],
+            'held_locks': [lock(match, line)
+                           for (match, line) in self.held_locks],
+            'stack': [symbolize(line) for line in self.backtrace],
+        }
+        for kind, (match, line) in self.locks.items():
+            record[kind] = lock(match, line)
+        return record
+
+
+def record_stacks(value):
+    """Yields the symbolized stacks of a structured record, which are the
+    lists under keys named 'stack' or '*_stack', possibly nested.
+    """
+    if isinstance(value, dict):
+        for key, item in value.items():
+            if key == 'stack' or key.endswith('_stack'):
+                yield item
+            else:
+                for stack in record_stacks(item):
+                    yield stack
+    elif isinstance(value, list):
+        for item in value:
+            for stack in record_stacks(item):
+                yield stack
+
+
+# Number of characters of output collected before it is written.
+OUTPUT_BUFFER_SIZE = 1 << 16
+
+
+def binary_stdout():
+    # Python 2 has no separate binary stdout.
+    return getattr(sys.stdout, 'buffer', sys.stdout)
+
+
+class OutputWriter(object):
+    """Collects output and writes it to a binary stream in large chunks.
+
+    Output is only written once OUTPUT_BUFFER_SIZE characters are collected
+    or on an explicit flush().
+    """
+    def __init__(self, stream):
+        self.stream = stream
+        self.chunks = []
+        self.size = 0
+
+    def write(self, text):
+        self.chunks.append(text)
+        self.size += len(text)
+        if self.size >= OUTPUT_BUFFER_SIZE:
+            self.write_chunks()
+
+    def write_chunks(self):
+        if self.chunks:
+            data = ''.join(self.chunks)
+            if not isinstance(data, bytes):
+                # Undecodable bytes of the input are read as surrogates,
+                # write them back unchanged.
+                data = data.encode('utf-8', 'surrogateescape')
+            self.stream.write(data)
+            self.chunks = []
+            self.size = 0
+
+    def flush(self):
+        self.write_chunks()
+        self.stream.flush()
+
+    def tell(self):
+        self.flush()
+        return self.stream.tell()
+
+    def close(self):
+        self.flush()
+        self.stream.close()
+
+
 class ReportProcessor(object):
-    def __init__(self, linux_paths, strip_paths):
+    def __init__(self, linux_paths, strip_paths, source=None, cache_dir=None,
+                 out=None, records=None, blame=None):
+        self.out = out if out != None else OutputWriter(binary_stdout())
+        # Whether output is flushed after every input line, for following
+        # live logs.
+        self.live = False
+        self.stripped_paths = {}
+        self.formatted_lines = {}
+        # Structured report records are written here as JSON lines.
+        self.records = records
+        # If set, top frames of records are attributed to commits before the
+        # records are written, which happens in batches.
+        self.blame = blame
+        self.pending_records = []
         self.strip_paths = strip_paths
         self.linux_paths = linux_paths
+        self.source = source
+        self.cache_dir = cache_dir
+        self.module_paths = {}
         self.module_symbolizers = {}
         self.module_offset_tables = {}
+        self.module_frame_caches = {}
         self.loaded_files = {}
-
-    def process_input(self, context_size, questionable):
-        for line in sys.stdin:
+        # KASLR offset of vmlinux, used to symbolize raw addresses.
+        self.kernel_offset = 0
+        # Canonical address of the bad access of the current report.
+        self.access_addr = None
+        # Lines of the report being buffered for batched symbolization, and
+        # the class that parses them.
+        self.report_lines = None
+        self.report_class = None
+        # Whether the backtrace of a buffered lockdep report has started
+        # (False) and whether frames of it have been seen (True).
+        self.report_backtrace = None
+
+    def reset(self):
+        # The KASLR offset and the bad access are only known from earlier
+        # lines of the same input, and server mode reuses processors.
+        self.kernel_offset = 0
+        self.access_addr = None
+
+    def process_input(self, context_size, questionable, input=None):
+        if input == None:
+            input = sys.stdin
+        self.reset()
+        for line in input:
             line = line.rstrip()
             line = self.strip_time(line)
             self.process_line(line, context_size, questionable)
+            if self.live:
+                self.out.flush()
+        self.flush_report(context_size, questionable)
+        self.out.flush()
+
+    def process_stack_dump(self, context_size, questionable, input=None):
+        """Symbolizes a dump of many stacks, e.g. from sysrq-t or from hung
+        task and RCU stall reports.
+
+        The whole dump is read first, and stacks are grouped by their frames.
+        Frames of all unique stacks are resolved in one batch. Each unique
+        stack is printed in full at its first occurrence, together with the
+        number of its occurrences, and later occurrences refer back to it.
+        """
+        if input == None:
+            input = sys.stdin
+        lines = [self.strip_time(line.rstrip()) for line in input]
+
+        # Stacks are runs of frames, possibly with context markers.
+        stacks = []
+        start = None
+        has_frames = False
+        for i, line in enumerate(lines + ['']):
+            is_frame = FRAME_RE.match(line) or FRAME_RAW_RE.match(line)
+            if is_frame or STACK_MARKER_RE.match(line):
+                if start == None:
+                    start = i
+                    has_frames = False
+                has_frames = has_frames or bool(is_frame)
+                continue
+            if start != None and has_frames:
+                # Addresses only differ between identical stacks if they
+                # are raw, in which case the address is also in the body.
+                key = tuple(FRAME_ADDR_PREFIX_RE.sub('', frame).strip()
+                            for frame in lines[start:i])
+                stacks.append((start, i, key))
+            start = None
+
+        counts = defaultdict(int)
+        first_lines = []
+        for start, end, key in stacks:
+            if counts[key] == 0:
+                first_lines.extend(lines[start:end])
+            counts[key] += 1
+        self.prefetch(first_lines, questionable)
+
+        stack_ids = {}
+        pos = 0
+        for start, end, key in stacks:
+            for line in lines[pos:start]:
+                self.process_report_line(line, context_size, questionable)
+            pos = end
+            if key in stack_ids:
+                print(' [stack #%d, see above]' % stack_ids[key],
+                      file=self.out)
+                continue
+            for line in lines[start:end]:
+                self.process_report_line(line, context_size, questionable)
+            if counts[key] > 1:
+                stack_ids[key] = len(stack_ids) + 1
+                print(' [stack #%d, %d times]' % (stack_ids[key],
+                      counts[key]), file=self.out)
+        for line in lines[pos:]:
+            self.process_report_line(line, context_size, questionable)
+
+        print('%d stacks, %d unique' % (len(stacks), len(counts)),
+              file=self.out)
+        for key, stack_id in sorted(stack_ids.items(),
+                                    key=lambda item: -counts[item[0]]):
+            print(' stack #%d: %d times' % (stack_id, counts[key]),
+                  file=self.out)
+        self.out.flush()
 
     def strip_time(self, line):
         # Strip time prefix if present.
@@ -221,14 +1387,227 @@ class ReportProcessor(object):
         return line
 
     def process_line(self, line, context_size, questionable):
+        # KFENCE and lockdep reports are buffered until their end, so that
+        # all of their stacks are symbolized in one batch.
+        if self.report_lines != None:
+            if not self.report_ended(line) and \
+                    len(self.report_lines) < MAX_REPORT_LINES:
+                self.report_lines.append(line)
+                # On kernels that mark the stack of the current task, the
+                # lockdep backtrace ends the report right away, instead of
+                # waiting for the next line, which may never come in live
+                # mode.
+                if self.report_backtrace and TASK_END_RE.match(line):
+                    self.flush_report(context_size, questionable)
+                return
+            self.flush_report(context_size, questionable)
+        if KFENCE_RE.match(line):
+            self.report_lines = [line]
+            self.report_class = KfenceReport
+            return
+        if LOCKDEP_RE.match(line):
+            self.report_lines = [line]
+            self.report_class = LockdepReport
+            self.report_backtrace = None
+            return
+        self.process_report_line(line, context_size, questionable)
+
+    def report_ended(self, line):
+        if REPORT_END_RE.match(line) or REPORT_START_RE.match(line):
+            return True
+        if self.report_class != LockdepReport:
+            return False
+        # Lockdep reports don't have an end marker, and end with the
+        # backtrace of the current task instead. Without a closing </TASK>,
+        # the first line after the backtrace ends it.
+        if line == 'stack backtrace:':
+            self.report_backtrace = False
+        elif self.report_backtrace != None:
+            if FRAME_RE.match(line):
+                self.report_backtrace = True
+            elif self.report_backtrace and not STACK_MARKER_RE.match(line):
+                return True
+        return False
+
+    def flush_report(self, context_size, questionable):
+        if self.report_lines == None:
+            return
+        lines = self.report_lines
+        self.report_lines = None
+        self.report_backtrace = None
+
+        self.prefetch(lines, questionable)
+        for line in lines:
+            self.process_report_line(line, context_size, questionable)
+        if self.records != None:
+            report = self.report_class(lines)
+            self.write_record(report.record(self.symbolize_frame))
+
+    def write_record(self, record):
+        if self.blame == None:
+            self.records.write(json.dumps(record, sort_keys=True) + '\n')
+            return
+        self.pending_records.append(record)
+        if len(self.pending_records) >= BLAME_BATCH_RECORDS:
+            self.flush_records()
+
+    def flush_records(self):
+        """Attributes the top frames of pending records to commits, blaming
+        each unique source line once, and writes the records.
+        """
+        if not self.pending_records:
+            return
+        records = self.pending_records
+        self.pending_records = []
+
+        frames = []
+        for record in records:
+            for stack in record_stacks(record):
+                for frame in stack[:BLAME_FRAMES]:
+                    for symbolized in frame.get('symbolized', []):
+                        fileline = symbolized['fileline'].rsplit(':', 1)
+                        if len(fileline) != 2 or not fileline[1].isdigit():
+                            continue
+                        path = self.repo_path(fileline[0])
+                        frames.append((symbolized, path, int(fileline[1])))
+
+        self.blame.blame((path, line) for (symbolized, path, line) in frames)
+        for symbolized, path, line in frames:
+            blame = self.blame.lookup(path, line)
+            if blame != None:
+                symbolized['blame'] = blame
+
+        for record in records:
+            self.records.write(json.dumps(record, sort_keys=True) + '\n')
+
+    def match_frame(self, line):
         # |RIP_RE| is less general than |FRAME_RE|, so try it first.
-        match = None
-        for regexp in [RIP_RE, LR_RE, KSAN_RE, FRAME_RE]:
+        for regexp in [RIP_RE, LR_RE, KSAN_RE, LOCKDEP_LOCK_RE, FRAME_RE]:
             match = regexp.match(line)
             if match:
-                break
+                return match
+        return None
+
+    def locate_frame(self, match):
+        """Returns the module and the module address of the instruction
+        following the call for a matched frame, or None.
+        """
+        try:
+            module = match.group('module')
+        except IndexError:
+            module = None
+
+        if module == None:
+            module = 'vmlinux'
+        else:
+            module += '.ko'
+
+        if not self.load_module(module, module == 'vmlinux'):
+            return None
+
+        loader = self.module_offset_tables[module]
+
+        size = int(match.group('size'), 16)
+        symbol_offset = loader.lookup_offset(match.group('function'), size)
+        if symbol_offset is None:
+            return None
+
+        return (module, symbol_offset + int(match.group('offset'), 16))
+
+    def prefetch(self, lines, questionable):
+        """Symbolizes all frames in |lines| with batched addr2line requests.
+
+        This covers raw frames and registers in register dumps as well. Their
+        addresses depend on the KASLR offset, which is tracked through the
+        lines the same way process_report_line() does.
+        Results end up in the frame caches, where process_report_line() and
+        symbolize_frame() find them.
+        """
+        locations = []
+        kernel_offset = self.kernel_offset
+        for line in lines:
+            match = KERNEL_OFFSET_RE.match(line)
+            if match:
+                offset = match.group('offset')
+                kernel_offset = int(offset, 16) if offset else 0
+                continue
+            match = LR_RAW_RE.match(line) or FRAME_RAW_RE.match(line)
+            if match:
+                if match.groupdict().get('precise') and not questionable:
+                    continue
+                raw_addrs = [self.raw_frame_addr(match)]
+            elif REGS_RE.match(line):
+                values = [int(value, 16) for (reg, value)
+                          in REG_RE.findall(line)]
+                raw_addrs = [(addr, False)
+                             for addr in canonicalize_addrs(values)]
+            else:
+                raw_addrs = None
+            if raw_addrs != None:
+                for addr, call in raw_addrs:
+                    module_addr = self.raw_module_addr(addr, call,
+                                                       kernel_offset)
+                    if module_addr != None:
+                        locations.append(('vmlinux', module_addr))
+                continue
+
+            match = self.match_frame(line)
+            if match == None:
+                continue
+            location = self.locate_frame(match)
+            if location == None:
+                continue
+            module, pc = location
+            precise = not match.groupdict().get('precise')
+            if match.groupdict().get('addr') != None and \
+                    module == 'vmlinux' and (precise or questionable):
+                kernel_offset = canonicalize_addr(
+                        int(match.group('addr'), 16)) - pc
+            locations.append((module, '0x%x' % (pc - 1)))
+
+        missing = defaultdict(list)
+        seen = set()
+        for module, module_addr in locations:
+            if (module, module_addr) in seen:
+                continue
+            seen.add((module, module_addr))
+            if self.module_frame_caches[module].lookup(module_addr) is None:
+                missing[module].append(module_addr)
+
+        for module, module_addrs in missing.items():
+            if module not in self.module_symbolizers:
+                self.module_symbolizers[module] = \
+                    Symbolizer(self.module_paths[module])
+            results = self.module_symbolizers[module].process_batch(
+                    module_addrs)
+            cache = self.module_frame_caches[module]
+            for module_addr, frames in zip(module_addrs, results):
+                cache.add(module_addr, frames)
+
+    def symbolize_frame(self, line):
+        """Returns a frame line with its symbolized locations as a dict."""
+        match = self.match_frame(line)
+        result = {'frame': match.group('body') if match else line.strip()}
+        location = self.locate_frame(match) if match else None
+        if location == None:
+            return result
+        module, pc = location
+        result['module'] = module
+        result['symbolized'] = [
+            {'function': func, 'fileline': self.strip(fileline.split(' (')[0])}
+            for (func, fileline) in self.resolve(module, '0x%x' % (pc - 1))
+        ]
+        return result
+
+    def process_report_line(self, line, context_size, questionable):
+        if REPORT_START_RE.match(line):
+            self.access_addr = None
+        if self.process_addr_line(line, context_size, questionable):
+            return
+
+        match = self.match_frame(line)
         if match == None:
-            print(line)
+            print(line, file=self.out)
             return
 
         prefix = match.group('prefix')
@@ -244,70 +1623,222 @@ class ReportProcessor(object):
         # Don't print frames with '?' until user asked otherwise.
         if not precise and not questionable:
             if '<EOI>' in match.group('prefix'):
-                print(match.group('prefix'))
+                print(match.group('prefix'), file=self.out)
             return
 
-        function = match.group('function')
-        offset = match.group('offset')
-        size = match.group('size')
-        try:
-            module = match.group('module')
-        except IndexError:
-            module = None
+        location = self.locate_frame(match)
+        if location == None:
+            print(line, file=self.out)
+            return
+        module, pc = location
 
-        if module == None:
-            module = 'vmlinux'
-        else:
-            module += '.ko'
+        # Frames with both an address and a symbol tell the KASLR offset.
+        if addr != None and module == 'vmlinux':
+            self.kernel_offset = canonicalize_addr(int(addr, 16)) - pc
 
-        if not self.load_module(module, module == 'vmlinux'):
-            print(line)
+        frames = self.resolve(module, '0x%x' % (pc - 1))
+
+        if len(frames) == 0:
+            print(line, file=self.out)
             return
 
-        symbolizer = self.module_symbolizers[module]
-        loader = self.module_offset_tables[module]
+        self.print_frames(frames, precise, prefix, addr, body, context_size)
 
-        symbol_offset = loader.lookup_offset(function, int(size, 16))
-        if symbol_offset is None:
-            print(line)
-            return
+    def process_addr_line(self, line, context_size, questionable):
+        """Handles lines that carry raw, possibly tagged, addresses.
 
-        instruction_offset = int(offset, 16)
-        module_addr = hex(symbol_offset + instruction_offset - 1);
+        Returns False if the line is not one of those.
+        """
+        match = KERNEL_OFFSET_RE.match(line)
+        if match:
+            offset = match.group('offset')
+            self.kernel_offset = int(offset, 16) if offset else 0
+            print(line, file=self.out)
+            return True
 
-        frames = symbolizer.process(module_addr)
+        match = ACCESS_RE.match(line)
+        if match:
+            self.access_addr = int(match.group('addr'), 16)
+            print(line, file=self.out)
+            return True
 
-        if len(frames) == 0:
-            print(line)
+        match = TAG_RE.match(line)
+        if match:
+            print(line, file=self.out)
+            if self.access_addr != None:
+                print('Tag mismatch: pointer tag %s, memory tag %s, '
+                      'canonical addr %016x' % (match.group('ptr_tag'),
+                      match.group('mem_tag'),
+                      canonicalize_addr(self.access_addr)), file=self.out)
+            return True
+
+        # |LR_RAW_RE| is less general than |REGS_RE|, so try it first.
+        for regexp in [LR_RAW_RE, FRAME_RAW_RE]:
+            match = regexp.match(line)
+            if match:
+                self.process_raw_frame(match, line, context_size,
+                                       questionable)
+                return True
+
+        if REGS_RE.match(line):
+            self.process_regs(line)
+            return True
+
+        return False
+
+    def process_raw_frame(self, match, line, context_size, questionable):
+        precise = True
+        if 'precise' in match.groupdict().keys():
+            precise = not match.group('precise')
+        if not precise and not questionable:
+            return
+        try:
+            addr = match.group('addr')
+        except IndexError:
+            addr = None
+        frames = self.resolve_raw_addr(*self.raw_frame_addr(match))
+        if not frames:
+            print(line, file=self.out)
             return
+        # The raw address says nothing, so print the function name instead.
+        self.print_frames(frames, precise, match.group('prefix'), addr,
+                          frames[-1][0], context_size)
+
+    def process_regs(self, line):
+        # Print the register dump as is, followed by the registers that
+        # point into kernel text.
+        print(line, file=self.out)
+        regs = REG_RE.findall(line)
+        values = canonicalize_addrs([int(value, 16) for (reg, value) in regs])
+        for (reg, value), addr in zip(regs, values):
+            frames = self.resolve_raw_addr(addr, False)
+            if frames:
+                self.print_frames(frames, True, ' %s: %016x ' % (reg, addr),
+                                  None, frames[-1][0], 0)
+
+    def raw_frame_addr(self, match):
+        """Returns the canonical address of a raw frame match, and whether it
+        is a return address."""
+        # Only 'pc :' points to the faulting instruction itself, others are
+        # return addresses.
+        call = 'reg' not in match.groupdict().keys() or \
+               match.group('reg') != 'pc'
+        return (canonicalize_addr(int(match.group('raw'), 16)), call)
+
+    def resolve_raw_addr(self, addr, call):
+        module_addr = self.raw_module_addr(addr, call, self.kernel_offset)
+        if module_addr == None:
+            return None
+        return self.resolve('vmlinux', module_addr)
+
+    def raw_module_addr(self, addr, call, kernel_offset):
+        # Raw addresses can only be symbolized against vmlinux, as module
+        # load addresses are unknown.
+        if not self.load_module('vmlinux', True):
+            return None
+        module_addr = addr - kernel_offset
+        if call:
+            module_addr -= 1
+        loader = self.module_offset_tables['vmlinux']
+        text_start = loader.lookup_offset('_stext', 0)
+        text_end = loader.lookup_offset('_etext', 0)
+        if text_start != None and text_end != None and \
+                not (text_start <= module_addr < text_end):
+            return None
+        if module_addr < 0:
+            return None
+        return '0x%x' % module_addr
 
+    def print_frames(self, frames, precise, prefix, addr, body, context_size):
+        # All frames of a location are formatted first and written at once.
+        output = []
         for i, frame in enumerate(frames):
             inlined = (i + 1 != len(frames))
             func, fileline = frame[0], frame[1]
             fileline = fileline.split(' (')[0] # strip ' (discriminator N)'
-            self.print_frame(inlined, precise, prefix, addr, func, fileline,
-                             body)
-            self.print_lines(fileline, context_size)
+            output.append(self.format_frame(inlined, precise, prefix, addr,
+                                            func, fileline, body))
+            if context_size != 0:
+                output.append(self.format_lines(fileline, context_size))
+        self.out.write(''.join(output))
 
     def load_module(self, module, prefix=False):
-        if module in self.module_symbolizers.keys():
+        if module in self.module_paths.keys():
             return True
 
         for path in self.linux_paths:
             module_path = find_file(path, module, prefix)
+            if module_path == None:
+                module_path = find_file(path, module + SIDECAR_SUFFIX)
             if module_path != None:
                 break
 
         if module_path == None:
             return False
 
-        self.module_symbolizers[module] = Symbolizer(module_path)
-        self.module_offset_tables[module] = SymbolOffsetTable(module_path)
+        self.module_paths[module] = module_path
+        if module_path.endswith(SIDECAR_SUFFIX):
+            sidecar = Sidecar(module_path)
+            self.module_offset_tables[module] = sidecar
+            self.module_frame_caches[module] = sidecar
+            return True
+        if self.cache_dir == None:
+            self.module_offset_tables[module] = SymbolOffsetTable(module_path)
+            self.module_frame_caches[module] = FrameCache()
+            return True
+
+        # Build the symbol table once and store it in the cache directory,
+        # all other processes symbolizing against the same binary map it.
+        # The lock makes processes that start together wait for the first
+        # one to build it instead of each building their own.
+        cache_prefix = cache_file_prefix(self.cache_dir, module_path)
+        symtab_path = cache_prefix + '.symtab'
+        if not os.path.exists(symtab_path):
+            with open(symtab_path + '.lock', 'a') as lock:
+                fcntl.flock(lock, fcntl.LOCK_EX)
+                if not os.path.exists(symtab_path):
+                    MappedSymbolOffsetTable.write(symtab_path,
+                            SymbolOffsetTable(module_path))
+        self.module_offset_tables[module] = \
+            MappedSymbolOffsetTable(symtab_path)
+        self.module_frame_caches[module] = FrameCache(cache_prefix + '.frames')
         return True
 
+    def preload(self, module):
+        """Builds the tables of |module| in the cache directory, so that
+        processes started after this map them from the start."""
+        if not self.load_module(module):
+            return
+        cache = self.module_frame_caches[module]
+        # Sidecars are already built.
+        if isinstance(cache, Sidecar):
+            return
+        if cache.path != None and cache.table == None:
+            with open(cache.path + '.lock', 'a') as lock:
+                fcntl.flock(lock, fcntl.LOCK_EX)
+                if not os.path.exists(cache.path):
+                    MappedTable.write(cache.path, [])
+            cache.map()
+
+    def resolve(self, module, module_addr):
+        cache = self.module_frame_caches[module]
+        frames = cache.lookup(module_addr)
+        if frames != None:
+            return frames
+        # Only start addr2line once there is something not in the cache.
+        if module not in self.module_symbolizers:
+            self.module_symbolizers[module] = \
+                Symbolizer(self.module_paths[module])
+        frames = self.module_symbolizers[module].process(module_addr)
+        cache.add(module_addr, frames)
+        return frames
+
     def load_file(self, path):
         if path in self.loaded_files.keys():
             return self.loaded_files[path]
+        if self.source != None:
+            self.loaded_files[path] = self.source.read(self.repo_path(path))
+            return self.loaded_files[path]
         try:
             with open(path) as f:
                 self.loaded_files[path] = f.readlines()
@@ -315,49 +1846,601 @@ class ReportProcessor(object):
         except:
             return None
 
-    def print_frame(self, inlined, precise, prefix, addr, func, fileline, body):
+    def repo_path(self, path):
+        # Turn a path reported by addr2line into a path relative to the
+        # root of the source repository.
         if self.strip_paths != None:
-            for path in self.strip_paths:
-                fileline_parts = fileline.split(path, 1)
-                if len(fileline_parts) >= 2:
-                    fileline = fileline_parts[1].lstrip('/')
+            for strip_path in self.strip_paths:
+                path_parts = path.split(strip_path, 1)
+                if len(path_parts) >= 2:
+                    path = path_parts[1]
+                    break
+        path = os.path.normpath(path.lstrip('/'))
+        while path.startswith('../'):
+            path = path[3:]
+        return path
+
+    def strip(self, fileline):
+        # Frames of a log share few paths, so strip each of them only once.
+        path, sep, line = fileline.rpartition(':')
+        if not sep:
+            path, line = fileline, ''
+        stripped = self.stripped_paths.get(path)
+        if stripped == None:
+            stripped = path
+            if self.strip_paths != None:
+                for strip_path in self.strip_paths:
+                    path_parts = stripped.split(strip_path, 1)
+                    if len(path_parts) >= 2:
+                        stripped = path_parts[1].lstrip('/')
+            self.stripped_paths[path] = stripped
+        return stripped + sep + line
+
+    def format_frame(self, inlined, precise, prefix, addr, func, fileline,
+                     body):
+        fileline = self.strip(fileline)
         if inlined:
             if addr != None:
                 addr = '     inline     ';
             body = func
         precise = '' if precise else '? '
         if addr != None:
-            print('%s[<%s>] %s%s %s' % (prefix, addr, precise, body, fileline))
-        else:
-            print('%s%s%s %s' % (prefix, precise, body, fileline))
-
-    def print_lines(self, fileline, context_size):
-        if context_size == 0:
-            return
+            return '%s[<%s>] %s%s %s\n' % (prefix, addr, precise, body,
+                                           fileline)
+        return '%s%s%s %s\n' % (prefix, precise, body, fileline)
+
+    def format_lines(self, fileline, context_size):
+        """Returns the source lines around |fileline|, formatted once for
+        each location.
+        """
+        key = (fileline, context_size)
+        if key not in self.formatted_lines:
+            self.formatted_lines[key] = \
+                self.format_lines_uncached(fileline, context_size)
+        return self.formatted_lines[key]
+
+    def format_lines_uncached(self, fileline, context_size):
         fileline = fileline.split(':')
         filename, linenum = fileline[0], fileline[1]
 
         try:
             linenum = int(linenum)
         except:
-            return
+            return ''
         assert linenum >= 0
         if linenum == 0: # addr2line failed to restore correct line info
-            return
+            return ''
         linenum -= 1 # addr2line reports line numbers starting with 1
 
-        start = max(0, linenum - context_size / 2)
+        start = max(0, linenum - context_size // 2)
         end = start + context_size
         lines = self.load_file(filename)
         if not lines:
-            return
+            return ''
 
-        for i, line in enumerate(lines[start:end]):
-            print('    {0:5d} {1}'.format(i + start + 1, line), end=' ')
+        return ''.join('    {0:5d} {1} '.format(i + start + 1, line)
+                       for (i, line) in enumerate(lines[start:end]))
+
+    def save_caches(self):
+        for module, cache in self.module_frame_caches.items():
+            cache.save()
+        if self.blame != None:
+            self.blame.save()
 
     def finalize(self):
+        if self.records != None:
+            self.flush_records()
         for module, symbolizer in self.module_symbolizers.items():
             symbolizer.close()
+        self.save_caches()
+        if self.source != None:
+            self.source.close()
+
+
+# Request classes served by the server mode and their scheduling weights.
+# While both classes have pending requests, interactive requests are
+# dispatched |weight| times as often as bulk ones.
+REQUEST_CLASSES = {
+    'interactive': 8,
+    'bulk': 1,
+}
+
+# Number of latency samples kept per request class for percentiles.
+LATENCY_SAMPLES = 1000
+
+# Seconds between saves of the frame caches of a server worker, so that the
+# other workers pick up what it resolved.
+WORKER_SAVE_INTERVAL = 10
+
+# Niceness of the workers that may run bulk requests. The worker reserved for
+# interactive requests keeps the default niceness, so that it wins the CPU
+# when bulk requests saturate the machine.
+BULK_WORKER_NICE = 10
+
+
+class Request(object):
+    def __init__(self, klass, data, conn):
+        self.klass = klass
+        self.data = data
+        self.conn = conn
+        self.arrival = time.time()
+
+
+class FairScheduler(object):
+    """A weighted fair scheduler over per-class request queues.
+
+    Each class has a virtual time that advances by 1/weight every time a
+    request of that class is dispatched; the pending class with the smallest
+    virtual time goes next. Reserved processors only take interactive
+    requests, so that an interactive request never waits behind a backfill
+    that saturates the pool, and other processors leave interactive requests
+    to idle reserved ones.
+    """
+    def __init__(self):
+        self.cond = threading.Condition()
+        self.queues = dict((klass, []) for klass in REQUEST_CLASSES)
+        self.vtime = dict((klass, 0.0) for klass in REQUEST_CLASSES)
+        self.running = dict((klass, 0) for klass in REQUEST_CLASSES)
+        self.idle_reserved = 0
+
+    def put(self, request):
+        with self.cond:
+            queue = self.queues[request.klass]
+            # A class that was idle must not be able to monopolize the
+            # processors by cashing in the virtual time it didn't use.
+            if not queue:
+                busy = [self.vtime[k] for k in REQUEST_CLASSES
+                        if self.queues[k] or self.running[k]]
+                if busy:
+                    self.vtime[request.klass] = \
+                        max(self.vtime[request.klass], min(busy))
+            queue.append(request)
+            self.cond.notify_all()
+
+    def pick(self, reserved):
+        best = None
+        for klass in REQUEST_CLASSES:
+            if not self.queues[klass]:
+                continue
+            if klass == 'interactive' and not reserved and self.idle_reserved:
+                continue
+            if klass != 'interactive' and reserved:
+                continue
+            if best == None or self.vtime[klass] < self.vtime[best]:
+                best = klass
+        return best
+
+    def get(self, reserved=False):
+        with self.cond:
+            while True:
+                klass = self.pick(reserved)
+                if klass != None:
+                    break
+                if reserved:
+                    self.idle_reserved += 1
+                self.cond.wait()
+                if reserved:
+                    self.idle_reserved -= 1
+            self.vtime[klass] += 1.0 / REQUEST_CLASSES[klass]
+            self.running[klass] += 1
+            return self.queues[klass].pop(0)
+
+    def done(self, request):
+        with self.cond:
+            self.running[request.klass] -= 1
+            self.cond.notify_all()
+
+    def pending(self, klass):
+        with self.cond:
+            return len(self.queues[klass])
+
+
+class LatencyMetrics(object):
+    """Per-class request counts and latency percentiles."""
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.counts = dict((klass, 0) for klass in REQUEST_CLASSES)
+        self.samples = dict((klass, []) for klass in REQUEST_CLASSES)
+
+    def record(self, klass, latency):
+        with self.lock:
+            self.counts[klass] += 1
+            samples = self.samples[klass]
+            samples.append(latency)
+            if len(samples) > LATENCY_SAMPLES:
+                samples.pop(0)
+
+    def percentile(self, samples, p):
+        if not samples:
+            return 0.0
+        samples = sorted(samples)
+        return samples[min(len(samples) - 1, int(len(samples) * p))]
+
+    def report(self, scheduler):
+        lines = []
+        with self.lock:
+            for klass in sorted(REQUEST_CLASSES):
+                samples = self.samples[klass]
+                lines.append('%s: requests=%d pending=%d '
+                             'p50=%.1fms p99=%.1fms max=%.1fms' % (
+                    klass, self.counts[klass], scheduler.pending(klass),
+                    self.percentile(samples, 0.5) * 1000,
+                    self.percentile(samples, 0.99) * 1000,
+                    max(samples or [0.0]) * 1000))
+        return '\n'.join(lines) + '\n'
+
+
+def run_worker(conn, processor_args, context_size, questionable, nice):
+    """Symbolizes requests received over |conn| in a worker process.
+
+    Each request is the raw report, and the reply is the symbolized report.
+    The worker exits when |conn| is closed or an empty request is received.
+    Workers run their own `git cat-file`, so the source is made here from
+    the (linux paths, strip paths, git dir, commit, cache dir) in
+    |processor_args|. Frame caches are saved to the cache dir every
+    WORKER_SAVE_INTERVAL seconds, after a request.
+    """
+    if nice:
+        os.nice(nice)
+    linux_paths, strip_paths, git_dir, commit, cache_dir = processor_args
+    source = None
+    if git_dir != None:
+        source = GitSource(git_dir, commit)
+    processor = ReportProcessor(linux_paths, strip_paths, source, cache_dir)
+    last_save = time.time()
+    try:
+        while True:
+            data = conn.recv_bytes()
+            if not data:
+                break
+            lines = data.decode('utf-8', 'replace').split('\n')
+            if lines and lines[-1] == '':
+                lines.pop()
+            out = io.StringIO()
+            processor.out = out
+            try:
+                processor.process_input(context_size, questionable, lines)
+            except Exception as e:
+                print('symbolizer error: %s' % e, file=out)
+            conn.send_bytes(out.getvalue().encode('utf-8'))
+            if time.time() - last_save >= WORKER_SAVE_INTERVAL:
+                processor.save_caches()
+                last_save = time.time()
+    except (EOFError, KeyboardInterrupt):
+        pass
+    processor.finalize()
+
+
+class SymbolizerServer(object):
+    """Serves symbolization requests over a unix socket.
+
+    A client sends the request class ('interactive' or 'bulk') on the first
+    line followed by the report, and shuts down its side of the connection.
+    The server replies with the symbolized report and closes the connection.
+    Sending 'stats' instead of a request class returns the latency metrics.
+
+    Requests are queued per class and dispatched by a FairScheduler to a pool
+    of worker processes, each with its own ReportProcessor made from
+    |processor_args| (see run_worker) and its own addr2line processes.
+    The workers share the symbol tables and frame caches in the cache dir,
+    and the tables of vmlinux are built before the workers start.
+    Workers are processes rather than threads, so that bulk requests don't
+    hold up interactive ones on the interpreter lock. With more than one
+    worker, the first one is reserved for interactive requests and the others
+    run at a lower priority.
+    """
+    def __init__(self, socket_path, processor_args, num_workers, context_size,
+                 questionable):
+        self.socket_path = socket_path
+        self.processor_args = processor_args
+        self.num_workers = num_workers
+        self.context_size = context_size
+        self.questionable = questionable
+        self.scheduler = FairScheduler()
+        self.metrics = LatencyMetrics()
+        self.workers = []
+
+    def serve(self):
+        if os.path.exists(self.socket_path):
+            os.unlink(self.socket_path)
+        sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        sock.bind(self.socket_path)
+        sock.listen(128)
+
+        linux_paths, strip_paths, _, _, cache_dir = self.processor_args
+        processor = ReportProcessor(linux_paths, strip_paths, None, cache_dir)
+        processor.preload('vmlinux')
+        processor.finalize()
+
+        for i in range(self.num_workers):
+            reserved = (i == 0 and self.num_workers > 1)
+            conn, worker_conn = multiprocessing.Pipe()
+            worker = multiprocessing.Process(target=run_worker,
+                    args=(worker_conn, self.processor_args, self.context_size,
+                          self.questionable,
+                          BULK_WORKER_NICE if i > 0 else 0))
+            worker.daemon = True
+            worker.start()
+            worker_conn.close()
+            lock = threading.Lock()
+            self.workers.append((worker, conn, lock))
+            self.start_thread(self.dispatch, (conn, lock, reserved))
+        while True:
+            conn, _ = sock.accept()
+            self.start_thread(self.receive, conn)
+
+    def stop(self):
+        # Let the workers finish their current request and save caches.
+        for worker, conn, lock in self.workers:
+            with lock:
+                try:
+                    conn.send_bytes(b'')
+                except (IOError, OSError):
+                    pass
+        for worker, conn, lock in self.workers:
+            worker.join()
+
+    def start_thread(self, target, arg):
+        thread = threading.Thread(target=target, args=(arg,))
+        thread.daemon = True
+        thread.start()
+
+    def receive(self, conn):
+        # Requests are only split into lines by the workers.
+        try:
+            chunks = []
+            while True:
+                chunk = conn.recv(1 << 16)
+                if not chunk:
+                    break
+                chunks.append(chunk)
+            klass, _, data = b''.join(chunks).partition(b'\n')
+            klass = klass.decode('utf-8', 'replace').strip()
+        except socket.error:
+            conn.close()
+            return
+
+        if klass == 'stats':
+            self.reply(conn, self.metrics.report(self.scheduler)
+                                 .encode('utf-8'))
+        elif klass not in REQUEST_CLASSES:
+            self.reply(conn, ('unknown request class: %s\n' % klass)
+                                 .encode('utf-8'))
+        elif data:
+            self.scheduler.put(Request(klass, data, conn))
+        else:
+            self.reply(conn, b'')
+
+    def reply(self, conn, output):
+        try:
+            conn.sendall(output)
+        except socket.error:
+            pass
+        conn.close()
+
+    def dispatch(self, args):
+        conn, lock, reserved = args
+        while True:
+            request = self.scheduler.get(reserved)
+            try:
+                with lock:
+                    conn.send_bytes(request.data)
+                    output = conn.recv_bytes()
+            except (EOFError, IOError, OSError):
+                # The worker is gone.
+                self.reply(request.conn, b'symbolizer error: worker exited\n')
+                self.scheduler.done(request)
+                return
+            self.reply(request.conn, output)
+            self.scheduler.done(request)
+            self.metrics.record(request.klass, time.time() - request.arrival)
+
+
+class Checkpoint(object):
+    """Progress of a batch run, stored as a JSON file.
+
+    A checkpoint is only taken right before the first line of a report, so
+    everything before |input_offset| has been fully symbolized and written
+    to the output before |output_offset|, and to the structured records
+    before |records_offset|. The KASLR offset seen before |input_offset| is
+    kept too, so that raw frames after it resolve the same way on resume.
+
+    Of the completed reports, only the count and the input range of the last
+    one are kept: every report before |input_offset| is complete, so earlier
+    ranges add nothing for resuming, and the checkpoint doesn't grow with
+    the archive.
+
+    The paths of the files, and a hash of the input before |input_offset|,
+    tell whether a rerun is given the same files, which may have grown since.
+    """
+    VERSION = 2
+
+    def __init__(self, path):
+        self.path = path
+        self.input_path = None
+        self.input_digest = None
+        self.output_path = None
+        self.records_path = None
+        self.input_offset = 0
+        self.output_offset = 0
+        self.records_offset = 0
+        self.kernel_offset = 0
+        self.reports = 0
+        self.last_report = None
+        self.cache_dir = None
+
+    def load(self):
+        if not os.path.exists(self.path):
+            return False
+        with open(self.path) as f:
+            state = json.load(f)
+        if state.get('version') != self.VERSION:
+            raise ValueError('unsupported checkpoint version %s' %
+                             state.get('version'))
+        self.input_path = state['input_path']
+        self.input_digest = state['input_digest']
+        self.output_path = state['output_path']
+        self.records_path = state['records_path']
+        self.input_offset = state['input_offset']
+        self.output_offset = state['output_offset']
+        self.records_offset = state['records_offset']
+        self.kernel_offset = state['kernel_offset']
+        self.reports = state['reports']
+        self.last_report = state['last_report']
+        self.cache_dir = state['cache_dir']
+        return True
+
+    def save(self):
+        state = {
+            'version': self.VERSION,
+            'input_path': self.input_path,
+            'input_digest': self.input_digest,
+            'output_path': self.output_path,
+            'records_path': self.records_path,
+            'input_offset': self.input_offset,
+            'output_offset': self.output_offset,
+            'records_offset': self.records_offset,
+            'kernel_offset': self.kernel_offset,
+            'reports': self.reports,
+            'last_report': self.last_report,
+            'cache_dir': self.cache_dir,
+        }
+        fd, tmp_path = tempfile.mkstemp(
+                dir=os.path.dirname(os.path.abspath(self.path)))
+        with os.fdopen(fd, 'w') as f:
+            json.dump(state, f)
+        os.rename(tmp_path, self.path)
+
+    def check(self, input_path, output_path, records_path):
+        """Raises ValueError if the run can't be resumed with these files.
+
+        Returns the hash of the input before |input_offset|, for the resumed
+        run to continue.
+        """
+        if self.input_path != os.path.abspath(input_path) or \
+                self.output_path != os.path.abspath(output_path):
+            raise ValueError('taken for --input=%s --output=%s' %
+                             (self.input_path, self.output_path))
+        if records_path != None:
+            records_path = os.path.abspath(records_path)
+        if self.records_path != records_path:
+            raise ValueError('taken for --json=%s' % self.records_path)
+        for path, offset in [(output_path, self.output_offset),
+                             (records_path, self.records_offset)]:
+            if path == None:
+                continue
+            if not os.path.exists(path) or \
+                    os.path.getsize(path) < offset:
+                raise ValueError('%s is shorter than when checkpointed' %
+                                 path)
+
+        digest = hashlib.sha1()
+        remaining = self.input_offset
+        with open(input_path, 'rb') as f:
+            while remaining > 0:
+                chunk = f.read(min(remaining, 1 << 20))
+                if not chunk:
+                    break
+                digest.update(chunk)
+                remaining -= len(chunk)
+        if remaining > 0 or digest.hexdigest() != self.input_digest:
+            raise ValueError('%s differs from when checkpointed' % input_path)
+        return digest
+
+
+def process_batch(processor, input_path, output_path, records_path,
+                  checkpoint, digest, interval, context_size, questionable):
+    """Symbolizes |input_path| into |output_path| taking checkpoints.
+
+    If |digest| is given, the run resumes from the loaded checkpoint, which
+    Checkpoint.check() has matched against the files and which returned the
+    hash of the input so far: the output is truncated to the checkpointed
+    position and the input is read from the checkpointed offset. Otherwise,
+    the output is started from scratch. Frame caches are saved with every
+    checkpoint, so the resumed run doesn't redo addr2line work.
+    """
+    records = processor.records
+    if digest != None:
+        with open(output_path, 'ab') as out:
+            out.truncate(checkpoint.output_offset)
+        if records != None:
+            records.truncate(checkpoint.records_offset)
+    else:
+        digest = hashlib.sha1()
+        open(output_path, 'wb').close()
+        if records != None:
+            records.truncate(0)
+    checkpoint.input_path = os.path.abspath(input_path)
+    checkpoint.output_path = os.path.abspath(output_path)
+    if records_path != None:
+        checkpoint.records_path = os.path.abspath(records_path)
+    if processor.cache_dir != None:
+        checkpoint.cache_dir = os.path.abspath(processor.cache_dir)
+
+    last_checkpoint = time.time()
+    report_start = None
+    with open(input_path, 'rb') as input, \
+            open(output_path, 'ab') as out:
+        processor.out = OutputWriter(out)
+        processor.reset()
+        processor.kernel_offset = checkpoint.kernel_offset
+        input.seek(checkpoint.input_offset)
+        offset = checkpoint.input_offset
+        for raw_line in input:
+            line = raw_line.decode('utf-8', 'replace').rstrip()
+            line = processor.strip_time(line)
+            if REPORT_START_RE.match(line):
+                if report_start != None:
+                    checkpoint.reports += 1
+                    checkpoint.last_report = [report_start, offset]
+                report_start = offset
+                if time.time() - last_checkpoint >= interval:
+                    processor.flush_report(context_size, questionable)
+                    take_checkpoint(processor, checkpoint, offset, digest)
+                    last_checkpoint = time.time()
+            processor.process_line(line, context_size, questionable)
+            digest.update(raw_line)
+            offset += len(raw_line)
+
+        if report_start != None:
+            checkpoint.reports += 1
+            checkpoint.last_report = [report_start, offset]
+        processor.flush_report(context_size, questionable)
+        take_checkpoint(processor, checkpoint, offset, digest)
+
+
+def take_checkpoint(processor, checkpoint, offset, digest):
+    if processor.records != None:
+        processor.flush_records()
+    processor.save_caches()
+    processor.out.flush()
+    checkpoint.input_offset = offset
+    checkpoint.input_digest = digest.hexdigest()
+    checkpoint.kernel_offset = processor.kernel_offset
+    checkpoint.output_offset = processor.out.tell()
+    if processor.records != None:
+        processor.records.flush()
+        checkpoint.records_offset = processor.records.tell()
+    checkpoint.save()
+
+
+def send_request(socket_path, klass):
+    sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    sock.connect(socket_path)
+    sock.sendall((klass + '\n').encode('utf-8'))
+    if klass != 'stats':
+        while True:
+            chunk = sys.stdin.buffer.read(1 << 16)
+            if not chunk:
+                break
+            sock.sendall(chunk)
+    sock.shutdown(socket.SHUT_WR)
+    while True:
+        chunk = sock.recv(1 << 16)
+        if not chunk:
+            break
+        sys.stdout.buffer.write(chunk)
+    sock.close()
 
 
 def print_usage():
@@ -365,13 +2448,28 @@ def print_usage():
     print('[--strip=<strip path>]', end=' ')
     print('[--context=<lines before/after>]', end=' ')
     print('[--questionable]', end=' ')
+    print('[--git-dir=<repo path> --commit=<commit id>]', end=' ')
+    print('[--cache-dir=<cache path>]', end=' ')
+    print('[--serve=<socket path> [--workers=<number>]]', end=' ')
+    print('[--connect=<socket path> [--class=<interactive|bulk|stats>]]',
+          end=' ')
+    print('[--json=<records path> [--blame]]', end=' ')
+    print('[--input=<log path> --output=<output path>', end=' ')
+    print('[--checkpoint=<checkpoint path>', end=' ')
+    print('[--checkpoint-interval=<seconds>]]]', end=' ')
+    print('[--make-sidecar=<binary path>]', end=' ')
+    print('[--stack-dump]', end=' ')
     print()
 
 
 def main():
     try:
-        opts, args = getopt.getopt(sys.argv[1:], 'l:s:c:q:',
-                ['linux=', 'strip=', 'context=', 'questionable'])
+        opts, args = getopt.getopt(sys.argv[1:], 'l:s:c:q',
+                ['linux=', 'strip=', 'context=', 'questionable',
+                 'git-dir=', 'commit=', 'cache-dir=', 'serve=', 'workers=',
+                 'connect=', 'class=', 'input=', 'output=', 'checkpoint=',
+                 'checkpoint-interval=', 'json=', 'blame', 'make-sidecar=',
+                 'stack-dump'])
     except:
         print_usage()
         sys.exit(1)
@@ -380,6 +2478,21 @@ def main():
     strip_paths = []
     context_size = 0
     questionable = False
+    git_dir = None
+    commit = None
+    cache_dir = None
+    serve_path = None
+    workers = '4'
+    connect_path = None
+    klass = 'interactive'
+    input_path = None
+    output_path = None
+    checkpoint_path = None
+    checkpoint_interval = '60'
+    records_path = None
+    blame = False
+    sidecar_paths = []
+    stack_dump = False
 
     for opt, arg in opts:
         if opt in ('-l', '--linux'):
@@ -390,6 +2503,45 @@ def main():
             context_size = arg
         elif opt in ('-q', '--questionable'):
             questionable = True
+        elif opt == '--git-dir':
+            git_dir = arg
+        elif opt == '--commit':
+            commit = arg
+        elif opt == '--cache-dir':
+            cache_dir = arg
+        elif opt == '--serve':
+            serve_path = arg
+        elif opt == '--workers':
+            workers = arg
+        elif opt == '--connect':
+            connect_path = arg
+        elif opt == '--class':
+            klass = arg
+        elif opt == '--input':
+            input_path = arg
+        elif opt == '--output':
+            output_path = arg
+        elif opt == '--checkpoint':
+            checkpoint_path = arg
+        elif opt == '--checkpoint-interval':
+            checkpoint_interval = arg
+        elif opt == '--json':
+            records_path = arg
+        elif opt == '--blame':
+            blame = True
+        elif opt == '--make-sidecar':
+            sidecar_paths.append(arg)
+        elif opt == '--stack-dump':
+            stack_dump = True
+
+    if connect_path != None:
+        send_request(connect_path, klass)
+        sys.exit(0)
+
+    if sidecar_paths:
+        for binary_path in sidecar_paths:
+            Sidecar.write(binary_path + SIDECAR_SUFFIX, binary_path)
+        sys.exit(0)
 
     if len(linux_paths) == 0:
         linux_paths = [os.getcwd()]
@@ -399,13 +2551,101 @@ def main():
     try:
         if isinstance(context_size, str):
             context_size = int(context_size)
+        workers = int(workers)
+        checkpoint_interval = float(checkpoint_interval)
     except:
         print_usage()
         sys.exit(1)
 
-    processor = ReportProcessor(linux_paths, strip_paths)
-    processor.process_input(context_size, questionable)
+    # Source context can be read from a git repository instead of the
+    # checked out tree, in which case both the repository and the commit the
+    # kernel was built from must be given.
+    if (git_dir == None) != (commit == None):
+        print_usage()
+        sys.exit(1)
+    # Blaming frames needs both the repository and structured records.
+    if blame and (git_dir == None or records_path == None):
+        print_usage()
+        sys.exit(1)
+
+    # Batch runs are resumed with the caches of the interrupted run.
+    checkpoint = None
+    if checkpoint_path != None:
+        if input_path == None or output_path == None:
+            print_usage()
+            sys.exit(1)
+        checkpoint = Checkpoint(checkpoint_path)
+        digest = None
+        try:
+            if checkpoint.load():
+                digest = checkpoint.check(input_path, output_path,
+                                          records_path)
+        except ValueError as e:
+            print('cannot resume from %s: %s' % (checkpoint_path, e),
+                  file=sys.stderr)
+            sys.exit(1)
+        if cache_dir == None and digest != None:
+            cache_dir = checkpoint.cache_dir
+
+    if cache_dir == None and serve_path != None:
+        # Server workers share their tables through the cache directory.
+        cache_dir = tempfile.mkdtemp(prefix='symbolizer-')
+    if cache_dir != None and not os.path.isdir(cache_dir):
+        os.makedirs(cache_dir)
+
+    if serve_path != None:
+        server = SymbolizerServer(serve_path,
+                (linux_paths, strip_paths, git_dir, commit, cache_dir),
+                max(1, workers), context_size, questionable)
+        try:
+            server.serve()
+        except KeyboardInterrupt:
+            pass
+        server.stop()
+        sys.exit(0)
+
+    source = None
+    if git_dir != None:
+        source = GitSource(git_dir, commit)
+
+    # Batch runs truncate the records file themselves when resuming.
+    records = None
+    if records_path != None:
+        records = io.open(records_path, 'a' if checkpoint else 'w',
+                          encoding='utf-8')
+
+    if blame:
+        blame = GitBlame(git_dir, commit, source, cache_dir)
+    else:
+        blame = None
+
+    processor = ReportProcessor(linux_paths, strip_paths, source, cache_dir,
+                                records=records, blame=blame)
+    if checkpoint != None:
+        process_batch(processor, input_path, output_path, records_path,
+                      checkpoint, digest, checkpoint_interval, context_size,
+                      questionable)
+        processor.finalize()
+        if records != None:
+            records.close()
+        sys.exit(0)
+
+    input = sys.stdin
+    if input_path != None:
+        input = io.open(input_path, encoding='utf-8', errors='replace')
+    if output_path != None:
+        processor.out = OutputWriter(open(output_path, 'wb'))
+    else:
+        processor.live = sys.stdout.isatty()
+    if stack_dump:
+        processor.process_stack_dump(context_size, questionable, input)
+    else:
+        processor.process_input(context_size, questionable, input)
     processor.finalize()
+    if output_path != None:
+        processor.out.close()
+    if records != None:
+        records.close()
 
     sys.exit(0)
 